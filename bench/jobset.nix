@@ -0,0 +1,39 @@
+/* A synthetic jobset for benchmarking: a tree of attribute sets with
+   'fanOut' children per level and 'depth' levels, whose leaves are
+   jobs. Each job costs about 'leafCost' additions to evaluate,
+   allocates 'leafAlloc' strings that stay live, and is a chain of
+   'derivations' derivations. */
+
+{ fanOut ? 10
+, depth ? 3
+, leafCost ? 1000
+, leafAlloc ? 0
+, derivations ? 1
+, system ? "x86_64-linux"
+}:
+
+let
+
+  mkJob = path:
+    let
+      cost = builtins.foldl' (a: b: a + b) 0 (builtins.genList (x: x) leafCost);
+
+      alloc = builtins.concatStringsSep "," (builtins.genList (x: "${path}-${toString x}") leafAlloc);
+
+      drv = n: derivation {
+        name = "bench-${path}-${toString n}";
+        inherit system cost;
+        builder = "/bin/sh";
+        args = [ "-c" "echo ${toString n} > $out" ];
+        dep = if n == 0 then alloc else drv (n - 1);
+      };
+
+    in drv (derivations - 1);
+
+  mkTree = level: path:
+    if level == depth then mkJob path
+    else builtins.listToAttrs (builtins.genList (i:
+      let name = "a${toString i}"; in
+      { inherit name; value = mkTree (level + 1) "${path}${name}"; }) fanOut);
+
+in mkTree 0 "job"
@@ -0,0 +1,80 @@
+/* Microbenchmark of the master/worker message framing against the
+   line protocol it replaced: a child process sends a stream of typical
+   messages over a pipe and the parent decodes them. */
+
+#include <chrono>
+#include <iostream>
+
+#include <nix/config.h>
+#include <nix/shared.hh>
+#include <nix/util.hh>
+
+#include <nlohmann/json.hpp>
+
+#include "protocol.hh"
+
+using namespace nix;
+
+static const size_t nrMessages = 2000;
+
+/* An 'attrs' reply for a large attribute set, and a small one. */
+static nlohmann::json makeMessage(size_t nrAttrs)
+{
+    auto attrs = nlohmann::json::array();
+    for (size_t i = 0; i < nrAttrs; i++)
+        attrs.push_back("package-" + std::to_string(i));
+    nlohmann::json reply;
+    reply["attrs"] = std::move(attrs);
+    return nlohmann::json::array({reply});
+}
+
+static void run(const std::string & name, const nlohmann::json & msg,
+    std::function<void(int, const nlohmann::json &)> send,
+    std::function<nlohmann::json(int)> receive)
+{
+    Pipe pipe;
+    pipe.create();
+
+    Pid pid = startProcess([&]() {
+        pipe.readSide = -1;
+        for (size_t i = 0; i < nrMessages; i++)
+            send(pipe.writeSide.get(), msg);
+        _exit(0);
+    }, ProcessOptions { .allowVfork = false });
+
+    pipe.writeSide = -1;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0;
+    for (size_t i = 0; i < nrMessages; i++)
+        total += receive(pipe.readSide.get()).size();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    pid.wait();
+
+    if (total != nrMessages * msg.size())
+        throw Error("%s: received the wrong messages", name);
+
+    std::cout << fmt("%-30s %10.0f messages/s", name, nrMessages / elapsed.count()) << std::endl;
+}
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        for (auto nrAttrs : {1, 100, 5000}) {
+            auto msg = makeMessage(nrAttrs);
+
+            run(fmt("lines, %d attrs", nrAttrs), msg,
+                [](int fd, const nlohmann::json & msg) { writeLine(fd, msg.dump()); },
+                [](int fd) { return nlohmann::json::parse(readLine(fd)); });
+
+            std::unique_ptr<MessageReader> reader;
+            run(fmt("frames, %d attrs", nrAttrs), msg,
+                [](int fd, const nlohmann::json & msg) { writeMessage(fd, msg); },
+                [&](int fd) {
+                    if (!reader) reader = std::make_unique<MessageReader>(fd);
+                    return reader->read();
+                });
+        }
+    });
+}
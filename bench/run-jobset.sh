@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# Evaluate the synthetic jobset in bench/jobset.nix against a throwaway
+# store, once for each number of workers, and report throughput, the
+# master's peak RSS and the number of worker restarts.
+#
+# Usage: run-jobset.sh HYDRA-EVAL-JOBS JOBSET.NIX
+#
+# The jobset's shape is taken from BENCH_FAN_OUT, BENCH_DEPTH,
+# BENCH_LEAF_COST, BENCH_LEAF_ALLOC and BENCH_DERIVATIONS; the worker
+# counts from BENCH_WORKERS; and the memory limit from
+# BENCH_MAX_MEMORY_SIZE (MiB).
+#
+# The store is served by a private nix-daemon, since workers can't
+# share a local store. Every worker count is run in three modes:
+# "central", with --central-writer, the master writing all derivations;
+# "workers", each worker writing its own; and "enumerate", with
+# --enumerate, listing the jobs without instantiating them. The master
+# reports its write rate in the first mode.
+
+set -euo pipefail
+
+evalJobs=$1
+jobset=$(realpath "$2")
+
+tmp=$(mktemp -d)
+trap 'chmod -R u+w "$tmp"; rm -rf "$tmp"' EXIT
+
+export NIX_REMOTE="local?root=$tmp/root"
+export XDG_CACHE_HOME="$tmp/cache"
+
+NIX_STATE_DIR="$tmp/state" nix-daemon &
+daemon=$!
+trap 'kill $daemon; chmod -R u+w "$tmp"; rm -rf "$tmp"' EXIT
+
+socket="$tmp/state/daemon-socket/socket"
+while [[ ! -S $socket ]]; do sleep 0.1; done
+export NIX_REMOTE="unix://$socket"
+
+modes=(central workers enumerate)
+
+args=(
+    -I "bench=$(dirname "$jobset")"
+    --arg fanOut "${BENCH_FAN_OUT:-10}"
+    --arg depth "${BENCH_DEPTH:-3}"
+    --arg leafCost "${BENCH_LEAF_COST:-1000}"
+    --arg leafAlloc "${BENCH_LEAF_ALLOC:-0}"
+    --arg derivations "${BENCH_DERIVATIONS:-1}"
+    --max-memory-size "${BENCH_MAX_MEMORY_SIZE:-4096}"
+    --gc-roots-dir "$tmp/gcroots"
+)
+
+printf '%-8s %-9s %12s %10s %12s %16s %9s\n' workers mode attributes attrs/s drvs/s "master RSS MiB" restarts
+
+for workers in ${BENCH_WORKERS:-1 2 4 8}; do
+    for mode in "${modes[@]}"; do
+        modeArgs=()
+        [[ $mode = central ]] && modeArgs=(--central-writer)
+        [[ $mode = enumerate ]] && modeArgs=(--enumerate)
+
+        "$evalJobs" "${args[@]}" "${modeArgs[@]}" --workers "$workers" "$jobset" > "$tmp/jobs.json" 2> "$tmp/log"
+
+        attrs=$(sed -n 's/^evaluated \([0-9]*\) attributes in .* (\([0-9.]*\) attributes\/s)$/\1/p' "$tmp/log")
+        rate=$(sed -n 's/^evaluated \([0-9]*\) attributes in .* (\([0-9.]*\) attributes\/s)$/\2/p' "$tmp/log")
+        drvRate=$(sed -n 's/^wrote [0-9]* derivations in .* (\([0-9.]*\) derivations\/s).*$/\1/p' "$tmp/log")
+        rss=$(sed -n 's/^master peak RSS was \([0-9]*\) MiB$/\1/p' "$tmp/log")
+        restarts=$(sed -n 's/^workers were restarted \([0-9]*\) times.*$/\1/p' "$tmp/log")
+
+        printf '%-8s %-9s %12s %10s %12s %16s %9s\n' "$workers" "$mode" "$attrs" "$rate" "${drvRate:--}" "$rss" "$restarts"
+    done
+done
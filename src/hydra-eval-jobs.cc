@@ -1,6 +1,12 @@
 #include <map>
+#include <list>
+#include <deque>
 #include <iostream>
+#include <chrono>
 #include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <regex>
 
 #include <nix/config.h>
 #include <nix/shared.hh>
@@ -16,24 +22,62 @@
 #include <nix/attr-path.hh>
 #include <nix/derivations.hh>
 #include <nix/local-fs-store.hh>
+#include <nix/sqlite.hh>
+
+#include <nix/remote-store.hh>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#include <gc/gc_allocator.h>
+#endif
 
 #include <nlohmann/json.hpp>
 
+#include "protocol.hh"
+
 using namespace nix;
 
 static Path gcRootsDir;
+static Path historyFile;
+static Path checkpointFile;
+static Path statsFile;
+static Path traceFile;
+static Path metricsFile;
 
 struct MyArgs : MixEvalArgs, MixCommonArgs
 {
     Path releaseExpr;
     bool flake = false;
     bool dryRun = false;
+    bool stream = false;
+    bool resume = false;
+    bool useCache = false;
+    bool incremental = false;
+    bool enumerate = false;
+    bool centralWriter = false;
+    std::set<std::string> jobFields;
     size_t nrWorkers = 1;
+    size_t nrSpareWorkers = 1;
     size_t maxMemorySize = 4096;
+    size_t softMemorySize = 0;
+    size_t maxHeapSizeOpt = 0;
+    unsigned int attrTimeout = 0;
+
+    size_t maxHeapSize() const
+    {
+        return maxHeapSizeOpt ? maxHeapSizeOpt : maxMemorySize * 2;
+    }
 
     MyArgs() : MixCommonArgs("hydra-eval-jobs")
     {
@@ -53,6 +97,75 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             .handler = {&gcRootsDir}
         });
 
+        addFlag({
+            .longName = "history-file",
+            .description = "file recording per-attribute evaluation costs, used to schedule expensive attributes first",
+            .labels = {"path"},
+            .handler = {&historyFile}
+        });
+
+        addFlag({
+            .longName = "stats-file",
+            .description = "file to write the time, CPU time and memory spent on each evaluated attribute to",
+            .labels = {"path"},
+            .handler = {&statsFile}
+        });
+
+        addFlag({
+            .longName = "trace-file",
+            .description = "file to write a Chrome trace of the master and worker processes to",
+            .labels = {"path"},
+            .handler = {&traceFile}
+        });
+
+        addFlag({
+            .longName = "metrics-file",
+            .description = "file to keep up to date with progress metrics in OpenMetrics format, e.g. for node_exporter's textfile collector",
+            .labels = {"path"},
+            .handler = {&metricsFile}
+        });
+
+        addFlag({
+            .longName = "checkpoint",
+            .description = "file recording evaluated attributes, to resume an interrupted evaluation from",
+            .labels = {"path"},
+            .handler = {&checkpointFile}
+        });
+
+        addFlag({
+            .longName = "resume",
+            .description = "resume from the checkpoint file, evaluating only the attributes it lacks",
+            .handler = {&resume, true}
+        });
+
+        addFlag({
+            .longName = "cache",
+            .description = "reuse the results of earlier evaluations of the same immutable inputs (impure fetches made by the expression are not tracked)",
+            .handler = {&useCache, true}
+        });
+
+        addFlag({
+            .longName = "incremental",
+            .description = "replay attributes whose source files haven't changed since an earlier evaluation",
+            .handler = {&incremental, true}
+        });
+
+        addFlag({
+            .longName = "job-fields",
+            .description = "comma-separated fields to include in jobs besides 'drvPath': outputs, system, nixName, description, license, maintainers, schedulingPriority, timeout, maxSilent, cost",
+            .labels = {"fields"},
+            .handler = {[=](std::string s) {
+                static const std::set<std::string> known{
+                    "outputs", "system", "nixName", "description", "license",
+                    "maintainers", "schedulingPriority", "timeout", "maxSilent", "cost"};
+                for (auto & field : tokenizeString<std::set<std::string>>(s, ",")) {
+                    if (!known.count(field))
+                        throw UsageError("unknown job field '%s'", field);
+                    jobFields.insert(field);
+                }
+            }}
+        });
+
         addFlag({
             .longName = "workers",
             .description = "number of evaluate workers",
@@ -62,6 +175,15 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             }}
         });
 
+        addFlag({
+            .longName = "spare-workers",
+            .description = "number of worker processes to keep ready to replace restarted workers",
+            .labels = {"workers"},
+            .handler = {[=](std::string s) {
+                nrSpareWorkers = std::stoi(s);
+            }}
+        });
+
         addFlag({
             .longName = "max-memory-size",
             .description = "maximum evaluation memory size",
@@ -71,12 +193,57 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             }}
         });
 
+        addFlag({
+            .longName = "soft-memory-size",
+            .description = "memory size above which a worker collects garbage (default: 3/4 of the maximum)",
+            .labels = {"size"},
+            .handler = {[=](std::string s) {
+                softMemorySize = std::stoi(s);
+            }}
+        });
+
+        addFlag({
+            .longName = "max-heap-size",
+            .description = "heap size at which an attribute fails as out of memory (default: twice the maximum memory size)",
+            .labels = {"size"},
+            .handler = {[=](std::string s) {
+                maxHeapSizeOpt = std::stoi(s);
+            }}
+        });
+
+        addFlag({
+            .longName = "attr-timeout",
+            .description = "seconds after which a worker still evaluating its attributes is killed, and the attribute fails (default: no limit)",
+            .labels = {"seconds"},
+            .handler = {[=](std::string s) {
+                attrTimeout = std::stoi(s);
+            }}
+        });
+
         addFlag({
             .longName = "dry-run",
             .description = "don't create store derivations",
             .handler = {&dryRun, true}
         });
 
+        addFlag({
+            .longName = "central-writer",
+            .description = "have the master write the derivations of all workers on one connection, rather than each worker writing its own",
+            .handler = {&centralWriter, true}
+        });
+
+        addFlag({
+            .longName = "enumerate",
+            .description = "only list the jobs and their systems, without instantiating derivations",
+            .handler = {&enumerate, true}
+        });
+
+        addFlag({
+            .longName = "stream",
+            .description = "print each job as a line of JSON as soon as it is evaluated",
+            .handler = {&stream, true}
+        });
+
         addFlag({
             .longName = "flake",
             .description = "build a flake",
@@ -89,6 +256,72 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
 
 static MyArgs myArgs;
 
+/* With --flake, the flake locked by the master. Workers inherit it
+   through the zygote. */
+static std::optional<flake::LockedFlake> lockedFlake;
+
+/* The store path of the flake or of the release expression. Files in
+   it are recorded relative to it by --incremental, so that they match
+   across revisions. */
+static Path mainSource;
+
+/* With --trace-file, the file that all processes append trace events
+   to. It's opened by the master, and shared with O_APPEND so that each
+   event is written in one piece. The file is a JSON array without the
+   closing bracket, which the trace viewers accept. */
+static AutoCloseFD traceFD;
+
+/* Microseconds on a clock that's the same in all processes. */
+static uint64_t traceClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void traceEvent(nlohmann::json event)
+{
+    if (!traceFD) return;
+    event["pid"] = getpid();
+    event["tid"] = syscall(SYS_gettid);
+    try {
+        writeFull(traceFD.get(), event.dump() + ",\n", false);
+    } catch (SysError & e) {
+        debug("cannot write trace event: %s", e.msg());
+    }
+}
+
+/* Name the calling process in the trace. */
+static void traceProcess(const std::string & name)
+{
+    traceEvent({{"name", "process_name"}, {"ph", "M"}, {"args", {{"name", fmt("%s %d", name, getpid())}}}});
+}
+
+static void traceInstant(const std::string & name, nlohmann::json args = nlohmann::json::object())
+{
+    if (traceFD)
+        traceEvent({{"name", name}, {"ph", "i"}, {"s", "p"}, {"ts", traceClock()}, {"args", std::move(args)}});
+}
+
+/* Trace the time between construction and destruction. */
+struct TraceSpan
+{
+    std::string name;
+    nlohmann::json args;
+    uint64_t start;
+
+    TraceSpan(const std::string & name, nlohmann::json args = nlohmann::json::object())
+        : name(name), args(std::move(args)), start(traceFD ? traceClock() : 0)
+    { }
+
+    ~TraceSpan()
+    {
+        if (traceFD)
+            traceEvent({{"name", name}, {"ph", "X"}, {"ts", start},
+                {"dur", traceClock() - start}, {"args", std::move(args)}});
+    }
+};
+
 static std::string queryMetaStrings(EvalState & state, DrvInfo & drv, const string & name, const string & subAttribute)
 {
     Strings res;
@@ -114,29 +347,74 @@ static std::string queryMetaStrings(EvalState & state, DrvInfo & drv, const stri
     return concatStringsSep(", ", res);
 }
 
-static void worker(
-    EvalState & state,
-    Bindings & autoArgs,
-    AutoCloseFD & to,
-    AutoCloseFD & from)
+/* The search path the evaluator uses: the -I entries, then those of
+   $NIX_PATH, which the evaluator read at startup, before main() unset
+   it. */
+static Strings getSearchPath()
+{
+    auto res = myArgs.searchPath;
+    for (auto & i : evalSettings.nixPath.get())
+        res.push_back(i);
+    return res;
+}
+
+/* Whether a search path entry refers to something that has to be
+   fetched, rather than to a local path. */
+static bool isFetchedSearchPath(const std::string & searchPath)
+{
+    return searchPath.find("://") != std::string::npos
+        || searchPath.find("channel:") != std::string::npos
+        || searchPath.find("flake:") != std::string::npos;
+}
+
+/* With --dry-run, nothing is written to the store, so derivation paths
+   can be computed against a dummy store, without connecting to the
+   daemon. A flake's inputs have to be fetched into the real store,
+   though, as do inputs fetched from URLs in the search path.
+
+   Otherwise, workers use the store the zygote opened, and a local
+   store's SQLite connection can't be used across fork(), so the store
+   has to be a daemon. */
+static ref<Store> openEvalStore()
+{
+    if (myArgs.dryRun && !myArgs.flake) {
+        bool fetched = false;
+        for (auto & entry : getSearchPath())
+            fetched = fetched || isFetchedSearchPath(entry);
+        if (!fetched) return openStore("dummy://");
+    }
+
+    auto store = openStore();
+
+    if (store.dynamic_pointer_cast<LocalFSStore>() && !store.dynamic_pointer_cast<RemoteStore>()) {
+        if (settings.storeUri.get() == "auto" && pathExists(settings.nixDaemonSocketFile))
+            return openStore("daemon");
+        throw Error("worker processes can't share the local store '%s'; use a daemon store, e.g. '--store daemon'",
+            store->getUri());
+    }
+
+    return store;
+}
+
+/* Evaluate the release expression (or the flake's Hydra jobs) and
+   apply the auto arguments, yielding the root of the job tree. */
+static Value * evaluateRoot(EvalState & state, Bindings & autoArgs)
 {
     Value vTop;
 
     if (myArgs.flake) {
         using namespace flake;
 
-        auto flakeRef = parseFlakeRef(myArgs.releaseExpr);
+        /* The master has locked the flake, so its inputs are already
+           in the store. */
+        if (state.allowedPaths)
+            state.allowedPaths->insert(lockedFlake->flake.sourceInfo->actualPath);
 
         auto vFlake = state.allocValue();
 
-        auto lockedFlake = lockFlake(state, flakeRef,
-            LockFlags {
-                .updateLockFile = false,
-                .useRegistries = false,
-                .allowMutable = false,
-            });
+        TraceSpan span("callFlake");
 
-        callFlake(state, lockedFlake, *vFlake);
+        callFlake(state, *lockedFlake, *vFlake);
 
         auto vOutputs = vFlake->attrs->get(state.symbols.create("outputs"))->value;
         state.forceValue(*vOutputs);
@@ -145,266 +423,2587 @@ static void worker(
         if (!aHydraJobs)
             aHydraJobs = vOutputs->attrs->get(state.symbols.create("checks"));
         if (!aHydraJobs)
-            throw Error("flake '%s' does not provide any Hydra jobs or checks", flakeRef);
+            throw Error("flake '%s' does not provide any Hydra jobs or checks", lockedFlake->flake.originalRef);
 
         vTop = *aHydraJobs->value;
 
     } else {
+        TraceSpan span("evalFile");
         state.evalFile(lookupFileArg(state, myArgs.releaseExpr), vTop);
     }
 
+    TraceSpan span("autoCallFunction");
     auto vRoot = state.allocValue();
     state.autoCallFunction(autoArgs, vTop, *vRoot);
 
-    while (true) {
-        /* Wait for the master to send us a job name. */
-        writeLine(to.get(), "next");
+    return vRoot;
+}
+
+/* The identity of a source file for --incremental: its path, with the
+   main source replaced by "<source>", and a hash of its contents. Store
+   paths outside the main source can't change and get no hash. A path
+   copied to the store is identified by the resulting store path, which
+   depends on its contents, as is the main source as a whole. */
+static std::pair<std::string, std::string> identifySourceFile(const Path & path, const Path & copiedTo = "")
+{
+    if (mainSource != "" && path == mainSource)
+        return {"<source>", copiedTo != "" ? copiedTo : mainSource};
+    if (mainSource != "" && isInDir(path, mainSource))
+        return {"<source>" + path.substr(mainSource.size()),
+            copiedTo != "" ? copiedTo : hashFile(htSHA256, path).to_string(Base32, false)};
+    if (isInDir(path, settings.nixStore))
+        return {path, ""};
+    return {path, copiedTo != "" ? copiedTo : hashFile(htSHA256, path).to_string(Base32, false)};
+}
+
+static bool refersToMainSource(Store & store, const std::string & drvPath);
+
+/* Collects the source files evaluated by this process for
+   --incremental, from the evaluator's "evaluating file" and "copied
+   source" messages. Workers inherit the zygote's, which the zygote
+   has already taken, so they only send their own.
+
+   A derivation can also use the main source without any of its files
+   being evaluated, e.g. through `src = ./.` in a flake or through
+   `self`. So once a derivation instantiated by this process refers to
+   the main source, the main source as a whole is added as a file.
+
+   Files read by builtins.readFile, readDir or pathExists, other than
+   through a derivation, aren't logged, so they are not tracked; that's
+   why --incremental is opt-in. */
+class DependencyLogger : public Logger
+{
+    Logger * prev;
+    Verbosity prevVerbosity;
+
+    std::vector<std::pair<std::string, std::string>> files;
+    size_t sent = 0;
+    bool sourceRecorded = false;
+
+public:
+
+    /* The store derivations are instantiated in, once it's open. */
+    Store * store = nullptr;
 
-        auto s = readLine(from.get());
-        if (s == "exit") break;
-        if (!hasPrefix(s, "do ")) abort();
-        std::string attrPath(s, 3);
+    DependencyLogger(Logger * prev, Verbosity prevVerbosity)
+        : prev(prev), prevVerbosity(prevVerbosity)
+    { }
 
-        debug("worker process %d at '%s'", getpid(), attrPath);
+    /* The files evaluated since the last call. */
+    nlohmann::json takeFiles()
+    {
+        auto res = nlohmann::json::array();
+        for (; sent < files.size(); sent++)
+            res.push_back({files[sent].first, files[sent].second});
+        return res;
+    }
 
-        /* Evaluate it and send info back to the master. */
-        nlohmann::json reply;
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        static std::regex evaluatingFile("evaluating file '(.*)'");
+        static std::regex copiedSource("copied source '(.*)' -> '(.*)'");
+        static std::regex instantiated("instantiated '(.*)' -> '(.*)'");
 
+        auto msg = filterANSIEscapes(fs.s, true);
+        std::smatch match;
         try {
-            auto vTmp = findAlongAttrPath(state, attrPath, autoArgs, *vRoot).first;
+            if (std::regex_match(msg, match, evaluatingFile))
+                files.push_back(identifySourceFile(match[1]));
+            else if (std::regex_match(msg, match, copiedSource))
+                files.push_back(identifySourceFile(match[1], match[2]));
+            else if (!sourceRecorded && store && std::regex_match(msg, match, instantiated)
+                && refersToMainSource(*store, match[2]))
+            {
+                files.push_back(identifySourceFile(mainSource));
+                sourceRecorded = true;
+            }
+        } catch (Error & e) {
+            debug("cannot track source file: %s", e.msg());
+        }
+
+        if (lvl <= prevVerbosity)
+            prev->log(lvl, fs);
+    }
+
+    void logEI(const ErrorInfo & ei) override
+    {
+        prev->logEI(ei);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        prev->warn(msg);
+    }
 
-            auto v = state.allocValue();
-            state.autoCallFunction(autoArgs, *vTmp, *v);
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        if (lvl <= prevVerbosity)
+            prev->startActivity(act, lvl, type, s, fields, parent);
+    }
 
-            if (auto drv = getDerivation(state, *v, false)) {
+    void stopActivity(ActivityId act) override
+    {
+        prev->stopActivity(act);
+    }
 
-                DrvInfo::Outputs outputs = drv->queryOutputs();
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        prev->result(act, type, fields);
+    }
 
-                if (drv->querySystem() == "unknown")
-                    throw EvalError("derivation must have a 'system' attribute");
+    void writeToStdout(std::string_view s) override
+    {
+        prev->writeToStdout(s);
+    }
 
-                auto drvPath = drv->queryDrvPath();
+    bool isVerbose() override
+    {
+        return prev->isVerbose();
+    }
+};
 
-                nlohmann::json job;
+static DependencyLogger * dependencyLogger = nullptr;
 
-                job["drvPath"] = drvPath;
+/* A daemon store that doesn't write derivations. Their paths are
+   computed locally, and their contents are handed to the master with
+   the replies, so that one writer submits the derivations of all
+   workers, each only once. Building writes them first, since import
+   from derivation needs them in the store, and the master may not have
+   written the ones handed to it yet. That's why they're kept after
+   they've been handed off, until they've been written. */
+struct DeferringStore : UDSRemoteStore
+{
+    std::deque<nlohmann::json> deferred;
+    size_t handedOff = 0, flushed = 0;
+
+    /* The deferred paths not written yet, and the size of the
+       derivations kept, which the garbage collector doesn't see. */
+    StorePathSet unflushed;
+    size_t deferredBytes = 0;
+
+    DeferringStore(const Params & params)
+        : StoreConfig(params)
+        , Store(params)
+        , UDSRemoteStore(params)
+    { }
+
+    DeferringStore(const std::string & socketPath, const Params & params)
+        : StoreConfig(params)
+        , Store(params)
+        , UDSRemoteStore("unix", socketPath, params)
+    { }
+
+    StorePath addTextToStore(const std::string & name, const std::string & s,
+        const StorePathSet & references, RepairFlag repair) override
+    {
+        if (!hasSuffix(name, drvExtension) || repair)
+            return UDSRemoteStore::addTextToStore(name, s, references, repair);
 
-                /* Register the derivation as a GC root.  !!! This
-                   registers roots for jobs that we may have already
-                   done. */
-                auto localStore = state.store.dynamic_pointer_cast<LocalFSStore>();
-                if (gcRootsDir != "" && localStore) {
-                    Path root = gcRootsDir + "/" + std::string(baseNameOf(drvPath));
-                    if (!pathExists(root))
-                        localStore->addPermRoot(localStore->parseStorePath(drvPath), root);
-                }
+        auto path = computeStorePathForText(name, s, references);
 
-                reply["job"] = std::move(job);
-            }
+        auto refs = nlohmann::json::array();
+        for (auto & i : references)
+            refs.push_back(printStorePath(i));
 
-            else if (v->type == tAttrs) {
-                auto attrs = nlohmann::json::array();
-                StringSet ss;
-                for (auto & i : v->attrs->lexicographicOrder()) {
-                    std::string name(i->name);
-                    if (name.find('.') != std::string::npos || name.find(' ') != std::string::npos) {
-                        printError("skipping job with illegal name '%s'", name);
-                        continue;
-                    }
-                    attrs.push_back(name);
-                }
-                reply["attrs"] = std::move(attrs);
-            }
+        deferred.push_back({
+            {"path", printStorePath(path)},
+            {"name", name},
+            {"contents", s},
+            {"references", std::move(refs)},
+        });
+        unflushed.insert(path);
+        deferredBytes += s.size();
 
-            else if (v->type == tNull)
-                ;
+        return path;
+    }
 
-            else throw TypeError("attribute '%s' is %s, which is not supported", attrPath, showType(*v));
+    /* Import from derivation asks whether a derivation is valid, and
+       copies the closure of string contexts, before building anything;
+       the deferred derivations must be in the store by then. */
+    bool isValidPathUncached(const StorePath & path) override
+    {
+        if (unflushed.count(path)) flush();
+        return UDSRemoteStore::isValidPathUncached(path);
+    }
 
-        } catch (EvalError & e) {
-            // Transmits the error we got from the previous evaluation
-            // in the JSON output.
-            reply["error"] = filterANSIEscapes(e.msg(), true);
-            // Don't forget to print it into the STDERR log, this is
-            // what's shown in the Hydra UI.
-            printError("error: %s", reply["error"]);
+    void queryPathInfoUncached(const StorePath & path,
+        Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept override
+    {
+        try {
+            if (unflushed.count(path)) flush();
+        } catch (...) {
+            callback.rethrow();
+            return;
         }
+        UDSRemoteStore::queryPathInfoUncached(path, std::move(callback));
+    }
+
+    void queryMissing(const std::vector<StorePathWithOutputs> & targets,
+        StorePathSet & willBuild, StorePathSet & willSubstitute, StorePathSet & unknown,
+        uint64_t & downloadSize, uint64_t & narSize) override
+    {
+        for (auto & i : targets)
+            if (unflushed.count(i.path)) {
+                flush();
+                break;
+            }
+        UDSRemoteStore::queryMissing(targets, willBuild, willSubstitute, unknown, downloadSize, narSize);
+    }
 
-        writeLine(to.get(), reply.dump());
+    void buildPaths(const std::vector<StorePathWithOutputs> & paths, BuildMode buildMode) override
+    {
+        flush();
+        UDSRemoteStore::buildPaths(paths, buildMode);
+    }
 
-        /* If our RSS exceeds the maximum, exit. The master will
-           start a new process. */
-        struct rusage r;
-        getrusage(RUSAGE_SELF, &r);
-        if ((size_t) r.ru_maxrss > myArgs.maxMemorySize * 1024) break;
+    /* Write the deferred derivations, in the order they were
+       instantiated so that references are written first. */
+    void flush()
+    {
+        for (; flushed < deferred.size(); flushed++) {
+            auto & drv = deferred[flushed];
+            UDSRemoteStore::addTextToStore(drv["name"], drv["contents"],
+                parseReferences(drv["references"]), NoRepair);
+        }
+        unflushed.clear();
+        trim();
+    }
+
+    /* The derivations instantiated since the last call. */
+    nlohmann::json takeDeferred()
+    {
+        auto res = nlohmann::json::array();
+        for (; handedOff < deferred.size(); handedOff++)
+            res.push_back(deferred[handedOff]);
+        trim();
+        return res;
+    }
+
+    /* Forget the derivations that have been both written and handed
+       off. */
+    void trim()
+    {
+        auto n = std::min(handedOff, flushed);
+        for (size_t i = 0; i < n; i++)
+            deferredBytes -= deferred[i]["contents"].get_ref<const std::string &>().size();
+        deferred.erase(deferred.begin(), deferred.begin() + n);
+        handedOff -= n;
+        flushed -= n;
+    }
+
+    StorePathSet parseReferences(const nlohmann::json & refs)
+    {
+        StorePathSet res;
+        for (auto & i : refs)
+            res.insert(parseStorePath((std::string) i));
+        return res;
     }
+};
+
+static DeferringStore * deferringStore = nullptr;
 
-    writeLine(to.get(), "restart");
+/* Whether a derivation refers to the main source, in its input sources
+   or its environment. One that can't be read, as with --dry-run, is
+   assumed to. */
+static bool refersToMainSource(Store & store, const std::string & drvPath)
+{
+    if (mainSource == "") return false;
+
+    try {
+        if (deferringStore)
+            for (auto i = deferringStore->deferred.rbegin(); i != deferringStore->deferred.rend(); ++i)
+                if ((*i)["path"] == drvPath)
+                    return ((std::string) (*i)["contents"]).find(mainSource) != std::string::npos;
+        return store.getFSAccessor()->readFile(drvPath).find(mainSource) != std::string::npos;
+    } catch (Error &) {
+        return true;
+    }
 }
 
-int main(int argc, char * * argv)
+/* In a worker, the pipe to the master. */
+static int masterFD = -1;
+
+/* Attribute sets a worker has already expanded, by attribute path, so
+   that evaluating their children doesn't have to walk down from the
+   root again. The values must be visible to the garbage collector.
+   Entries keep their attribute sets alive, so the cache is emptied
+   when it reaches maxAttrPathCacheSize; a worker mostly evaluates the
+   children of one parent after another, so that loses little. */
+static const size_t maxAttrPathCacheSize = 1024;
+
+#if HAVE_BOEHMGC
+typedef std::map<std::string, Value *, std::less<std::string>,
+    traceable_allocator<std::pair<const std::string, Value *>>> AttrPathCache;
+#else
+typedef std::map<std::string, Value *> AttrPathCache;
+#endif
+
+/* Return the value of an attribute path, auto-called like
+   findAlongAttrPath() does at every step, starting from the closest
+   ancestor in the cache. */
+static Value * lookupAttrPath(
+    EvalState & state,
+    Bindings & autoArgs,
+    Value & vRoot,
+    AttrPathCache & cache,
+    const std::string & attrPath)
 {
-    /* Prevent undeclared dependencies in the evaluation via
-       $NIX_PATH. */
-    unsetenv("NIX_PATH");
+    auto i = cache.find(attrPath);
+    if (i != cache.end()) return i->second;
+
+    Value * vTmp = &vRoot;
+
+    if (!attrPath.empty()) {
+        auto dot = attrPath.rfind('.');
+        std::string parentPath = dot == std::string::npos ? "" : std::string(attrPath, 0, dot);
+        std::string name = dot == std::string::npos ? attrPath : std::string(attrPath, dot + 1);
+
+        auto vParent = lookupAttrPath(state, autoArgs, vRoot, cache, parentPath);
+        if (vParent->type != tAttrs)
+            throw TypeError("the expression selected by the selection path '%s' should be a set but is %s",
+                parentPath, showType(*vParent));
+        if (cache.size() >= maxAttrPathCacheSize) cache.clear();
+        cache.emplace(parentPath, vParent);
+
+        auto a = vParent->attrs->find(state.symbols.create(name));
+        if (a == vParent->attrs->end())
+            throw Error("attribute '%s' in selection path '%s' not found", name, attrPath);
+        vTmp = a->value;
+    }
 
-    return handleExceptions(argv[0], [&]() {
-        initNix();
-        initGC();
+    auto v = state.allocValue();
+    state.autoCallFunction(autoArgs, *vTmp, *v);
+    state.forceValue(*v);
+    return v;
+}
 
-        myArgs.parseCmdline(argvToStrings(argc, argv));
+/* Evaluate a single attribute, returning the reply for the master. */
+static nlohmann::json evaluateAttr(
+    EvalState & state,
+    Bindings & autoArgs,
+    Value & vRoot,
+    AttrPathCache & cache,
+    const std::string & attrPath)
+{
+    debug("worker process %d at '%s'", getpid(), attrPath);
 
-        /* FIXME: The build hook in conjunction with import-from-derivation is causing "unexpected EOF" during eval */
-        settings.builders = "";
+    nlohmann::json reply;
 
-        /* Prevent access to paths outside of the Nix search path and
-           to the environment. */
-        evalSettings.restrictEval = true;
+    try {
+        auto v = lookupAttrPath(state, autoArgs, vRoot, cache, attrPath);
 
-        /* When building a flake, use pure evaluation (no access to
-           'getEnv', 'currentSystem' etc. */
-        evalSettings.pureEval = myArgs.flake;
+        if (auto drv = getDerivation(state, *v, false)) {
 
-        if (myArgs.dryRun) settings.readOnlyMode = true;
+            /* A derivation can ask for more time than --attr-timeout
+               to be instantiated. */
+            if (auto timeout = drv->queryMetaInt("evalTimeout", 0); timeout > 0)
+                writeMessage(masterFD, {{"timeout", timeout}});
 
-        if (myArgs.releaseExpr == "") throw UsageError("no expression specified");
+            auto system = drv->querySystem();
+            if (system == "unknown")
+                throw EvalError("derivation must have a 'system' attribute");
 
-        if (gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
+            nlohmann::json job;
 
-        struct State
-        {
-            std::set<std::string> todo{""};
-            std::set<std::string> active;
-            nlohmann::json jobs;
-            std::exception_ptr exc;
-        };
+            /* Computing the derivation path instantiates the
+               derivation and its dependencies, which is most of the
+               work for a job. */
+            if (myArgs.enumerate)
+                job["system"] = system;
+            else
+                job["drvPath"] = drv->queryDrvPath();
 
-        std::condition_variable wakeup;
+            /* Only compute the fields that were asked for. */
+            auto & fields = myArgs.jobFields;
 
-        Sync<State> state_;
+            if (fields.count("outputs")) {
+                nlohmann::json out;
+                for (auto & j : drv->queryOutputs())
+                    out[j.first] = j.second;
+                job["outputs"] = std::move(out);
+            }
 
-        /* Start a handler thread per worker process. */
-        auto handler = [&]()
-        {
-            try {
-                pid_t pid = -1;
-                AutoCloseFD from, to;
-
-                while (true) {
-
-                    /* Start a new worker process if necessary. */
-                    if (pid == -1) {
-                        Pipe toPipe, fromPipe;
-                        toPipe.create();
-                        fromPipe.create();
-                        pid = startProcess(
-                            [&,
-                             to{std::make_shared<AutoCloseFD>(std::move(fromPipe.writeSide))},
-                             from{std::make_shared<AutoCloseFD>(std::move(toPipe.readSide))}
-                            ]()
-                            {
-                                try {
-                                    EvalState state(myArgs.searchPath, openStore());
-                                    Bindings & autoArgs = *myArgs.getAutoArgs(state);
-                                    worker(state, autoArgs, *to, *from);
-                                } catch (std::exception & e) {
-                                    nlohmann::json err;
-                                    err["error"] = e.what();
-                                    writeLine(to->get(), err.dump());
-                                    // Don't forget to print it into the STDERR log, this is
-                                    // what's shown in the Hydra UI.
-                                    printError("error: %s", err["error"]);
-                                }
-                            },
-                            ProcessOptions { .allowVfork = false });
-                        from = std::move(fromPipe.readSide);
-                        to = std::move(toPipe.writeSide);
-                        debug("created worker process %d", pid);
-                    }
+            if (fields.count("system"))
+                job["system"] = system;
+            if (fields.count("nixName"))
+                job["nixName"] = drv->queryName();
+            if (fields.count("description"))
+                job["description"] = drv->queryMetaString("description");
+            if (fields.count("license"))
+                job["license"] = queryMetaStrings(state, *drv, "license", "shortName");
+            if (fields.count("maintainers"))
+                job["maintainers"] = queryMetaStrings(state, *drv, "maintainers", "email");
+            if (fields.count("schedulingPriority"))
+                job["schedulingPriority"] = drv->queryMetaInt("schedulingPriority", 100);
+            if (fields.count("timeout"))
+                job["timeout"] = drv->queryMetaInt("timeout", 36000);
+            if (fields.count("maxSilent"))
+                job["maxSilent"] = drv->queryMetaInt("maxSilent", 7200);
+
+            reply["job"] = std::move(job);
+        }
 
-                    /* Check whether the existing worker process is still there. */
-                    auto s = readLine(from.get());
-                    if (s == "restart") {
-                        pid = -1;
-                        continue;
-                    } else if (s != "next") {
-                        auto json = nlohmann::json::parse(s);
-                        throw Error("worker error: %s", (std::string) json["error"]);
-                    }
+        else if (v->type == tAttrs) {
+            auto attrs = nlohmann::json::array();
+            StringSet ss;
+            for (auto & i : v->attrs->lexicographicOrder()) {
+                std::string name(i->name);
+                if (name.find('.') != std::string::npos || name.find(' ') != std::string::npos) {
+                    printError("skipping job with illegal name '%s'", name);
+                    continue;
+                }
+                attrs.push_back(name);
+            }
+            reply["attrs"] = std::move(attrs);
 
-                    /* Wait for a job name to become available. */
-                    std::string attrPath;
+            /* The master will probably send us some of these next. */
+            cache.emplace(attrPath, v);
+        }
 
-                    while (true) {
-                        checkInterrupt();
-                        auto state(state_.lock());
-                        if ((state->todo.empty() && state->active.empty()) || state->exc) {
-                            writeLine(to.get(), "exit");
-                            return;
-                        }
-                        if (!state->todo.empty()) {
-                            attrPath = *state->todo.begin();
-                            state->todo.erase(state->todo.begin());
-                            state->active.insert(attrPath);
-                            break;
-                        } else
-                            state.wait(wakeup);
-                    }
+        else if (v->type == tNull)
+            ;
 
-                    /* Tell the worker to evaluate it. */
-                    writeLine(to.get(), "do " + attrPath);
+        else throw TypeError("attribute '%s' is %s, which is not supported", attrPath, showType(*v));
 
-                    /* Wait for the response. */
-                    auto response = nlohmann::json::parse(readLine(from.get()));
+    } catch (EvalError & e) {
+        // Transmits the error we got from the previous evaluation
+        // in the JSON output.
+        reply["error"] = filterANSIEscapes(e.msg(), true);
+        // Don't forget to print it into the STDERR log, this is
+        // what's shown in the Hydra UI.
+        printError("error: %s", reply["error"]);
+    }
 
-                    /* Handle the response. */
-                    StringSet newAttrs;
+    return reply;
+}
 
-                    if (response.find("job") != response.end()) {
-                        auto state(state_.lock());
-                        state->jobs[attrPath] = response["job"];
-                    }
+/* Return the CPU time used by this process, in seconds. */
+static double getCPUTime()
+{
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return r.ru_utime.tv_sec + r.ru_utime.tv_usec / 1e6
+        + r.ru_stime.tv_sec + r.ru_stime.tv_usec / 1e6;
+}
 
-                    if (response.find("attrs") != response.end()) {
-                        for (auto & i : response["attrs"]) {
-                            auto s = (attrPath.empty() ? "" : attrPath + ".") + (std::string) i;
-                            newAttrs.insert(s);
-                        }
-                    }
+/* Return the resident set size of a process (by default this one), in
+   bytes. */
+static size_t getCurrentRSS(const std::string & pid = "self")
+{
+    auto statm = "/proc/" + pid + "/statm";
+    auto fields = tokenizeString<std::vector<std::string>>(readFile(statm));
+    if (fields.size() < 2) throw Error("cannot parse '%s'", statm);
+    return std::stoull(fields[1]) * sysconf(_SC_PAGESIZE);
+}
 
-                    if (response.find("error") != response.end()) {
-                        auto state(state_.lock());
-                        state->jobs[attrPath]["error"] = response["error"];
-                    }
+/* Whether a worker has outgrown --max-memory-size. Above the soft
+   limit the worker collects garbage first: the RSS includes memory the
+   collector has freed (or not yet reclaimed), so only the live heap
+   counts against the hard limit. */
+static bool tooMuchMemory()
+{
+    size_t hardLimit = myArgs.maxMemorySize * 1024 * 1024;
+    size_t softLimit = myArgs.softMemorySize
+        ? myArgs.softMemorySize * 1024 * 1024
+        : hardLimit / 4 * 3;
+
+    if (getCurrentRSS() <= softLimit) return false;
+
+#if HAVE_BOEHMGC
+    /* Don't collect after every attribute once we're past the soft
+       limit; wait until a fair amount has been allocated. */
+    if (GC_get_bytes_since_gc() > softLimit / 8) {
+        debug("worker process %d is above the soft memory limit, collecting garbage", getpid());
+        GC_gcollect();
+    }
+    size_t deferredBytes = deferringStore ? deferringStore->deferredBytes : 0;
+    return GC_get_heap_size() - GC_get_free_bytes() + deferredBytes > hardLimit;
+#else
+    return getCurrentRSS() > hardLimit;
+#endif
+}
 
-                    /* Add newly discovered job names to the queue. */
-                    {
-                        auto state(state_.lock());
-                        state->active.erase(attrPath);
-                        for (auto & s : newAttrs)
-                            state->todo.insert(s);
-                        wakeup.notify_all();
-                    }
-                }
-            } catch (...) {
-                auto state(state_.lock());
-                state->exc = std::current_exception();
-                wakeup.notify_all();
-            }
-        };
+static void worker(
+    EvalState & state,
+    Bindings & autoArgs,
+    Value & vRoot,
+    AutoCloseFD & to,
+    AutoCloseFD & from)
+{
+    AttrPathCache cache;
 
-        std::vector<std::thread> threads;
-        for (size_t i = 0; i < myArgs.nrWorkers; i++)
-            threads.emplace_back(std::thread(handler));
+    MessageReader reader(from.get());
 
-        for (auto & thread : threads)
-            thread.join();
+    masterFD = to.get();
 
-        auto state(state_.lock());
+    bool restart = false;
+
+    while (!restart) {
+        /* Wait for the master to send us a batch of job names. */
+        writeMessage(to.get(), "next");
+
+        auto msg = [&]() {
+            TraceSpan span("wait for work");
+            return reader.read();
+        }();
+        if (msg == "exit") break;
+        auto & attrPaths = msg.at("do");
+
+        /* Evaluate them and send info back to the master, one reply
+           per attribute. */
+        auto replies = nlohmann::json::array();
+
+        for (auto & attrPath : attrPaths) {
+            /* Have the master hold this attribute, rather than the
+               whole batch, to --attr-timeout. */
+            if (myArgs.attrTimeout)
+                writeMessage(to.get(), {{"start", replies.size()}});
+
+            /* What the attribute costs, measured with counters that
+               are cheap to read. The evaluator's own counters (thunks,
+               function calls) are private to EvalState. */
+            auto startTime = std::chrono::steady_clock::now();
+            auto startCPUTime = getCPUTime();
+#if HAVE_BOEHMGC
+            auto allocated = GC_get_total_bytes();
+            auto heapSize = GC_get_heap_size();
+            auto collections = GC_get_gc_no();
+#endif
+
+            nlohmann::json reply;
+
+            try {
+                TraceSpan span("evaluate", {{"attr", attrPath}});
+                reply = evaluateAttr(state, autoArgs, vRoot, cache, attrPath);
+            } catch (std::bad_alloc &) {
+                /* We hit --max-heap-size. The heap may be in a bad
+                   state, so tell the master and start afresh. */
+                printError("error: worker process %d ran out of memory evaluating '%s'",
+                    getpid(), (std::string) attrPath);
+                replies.push_back({{"outOfMemory", true}});
+                restart = true;
+                break;
+            }
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+            auto & cost = reply["cost"];
+            cost["time"] = elapsed.count();
+            cost["cpuTime"] = getCPUTime() - startCPUTime;
+#if HAVE_BOEHMGC
+            cost["allocated"] = GC_get_total_bytes() - allocated;
+            /* The heap shrinks when memory is unmapped. */
+            cost["heapGrowth"] = (int64_t) GC_get_heap_size() - (int64_t) heapSize;
+            cost["collections"] = GC_get_gc_no() - collections;
+#endif
+
+            if (dependencyLogger)
+                reply["files"] = dependencyLogger->takeFiles();
+
+            if (deferringStore && deferringStore->handedOff < deferringStore->deferred.size())
+                reply["drvs"] = deferringStore->takeDeferred();
+
+            replies.push_back(std::move(reply));
+
+            /* If we use too much memory, exit. The master will start
+               a new process and hand the rest of the batch to another
+               worker. */
+            if (tooMuchMemory()) {
+                restart = true;
+                break;
+            }
+        }
+
+        writeMessage(to.get(), replies);
+    }
+
+    /* A worker that was told to exit just exits. */
+    if (restart) writeMessage(to.get(), "restart");
+}
+
+/* Send a message, optionally carrying file descriptors, over a
+   SOCK_SEQPACKET socket. */
+static void sendMessage(int fd, const std::string & msg, const std::vector<int> & fds = {})
+{
+    struct iovec iov;
+    iov.iov_base = (void *) msg.data();
+    iov.iov_len = msg.size();
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+    if (!fds.empty()) {
+        hdr.msg_control = control.data();
+        hdr.msg_controllen = control.size();
+        auto cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+
+    if (sendmsg(fd, &hdr, 0) == -1)
+        throw SysError("sending message");
+}
+
+/* Receive a message sent by sendMessage(). Returns an empty string if
+   the peer has closed the socket, and nothing if 'flags' include
+   MSG_DONTWAIT and there is no message. */
+static std::optional<std::string> receiveMessage(int fd, std::vector<AutoCloseFD> & fds, int flags = 0)
+{
+    std::vector<char> buf(65536);
+
+    struct iovec iov;
+    iov.iov_base = buf.data();
+    iov.iov_len = buf.size();
+
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC | flags)) == -1) {
+        if (errno == EAGAIN) return {};
+        if (errno != EINTR) throw SysError("receiving message");
+    }
+
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        size_t nrFDs = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nrFDs; i++) {
+            int fd2;
+            memcpy(&fd2, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.emplace_back(fd2);
+        }
+    }
+
+    return std::string(buf.data(), n);
+}
+
+/* Set this process's badness for the kernel's OOM killer. Raising it
+   needs no privileges. */
+static void setOOMScoreAdj(int adj)
+{
+    try {
+        writeFile("/proc/self/oom_score_adj", std::to_string(adj));
+    } catch (SysError & e) {
+        debug("cannot set OOM score: %s", e.msg());
+    }
+}
+
+/* Store connections are pooled, and the idle ones a worker inherits
+   from the zygote are shared with it and with every other worker, so
+   make the worker open its own. The store is always a daemon (see
+   openEvalStore()), or a dummy store without connections. */
+static void dropInheritedConnections(Store & store)
+{
+    auto remoteStore = dynamic_cast<RemoteStore *>(&store);
+    if (!remoteStore) return;
+    auto maxAge = std::to_string(remoteStore->maxConnectionAge.get());
+    remoteStore->set("max-connection-age", "0");
+    remoteStore->flushBadConnections();
+    remoteStore->set("max-connection-age", maxAge);
+}
+
+/* The zygote evaluates the root of the job tree once and then forks a
+   worker for every request from the master, so that starting (or
+   restarting) a worker costs a fork() rather than a re-evaluation.
+   Workers inherit the evaluated root copy-on-write. */
+static void zygote(AutoCloseFD & control)
+{
+    std::optional<EvalState> state;
+    Bindings * autoArgs = nullptr;
+    Value * vRoot = nullptr;
+    std::string error;
+
+    traceProcess("zygote");
+
+    /* The evaluator only reports the files it evaluates at higher
+       verbosity; the logger filters the extra messages out again. */
+    if (myArgs.incremental) {
+        logger = dependencyLogger = new DependencyLogger(logger, verbosity);
+        verbosity = std::max(verbosity, lvlChatty);
+    }
+
+    try {
+        auto store = openEvalStore();
+
+        /* Leave writing derivations to the master. The deferring store
+           talks to the same daemon socket, with the same parameters,
+           as the store just opened. */
+        auto daemon = store.dynamic_pointer_cast<UDSRemoteStore>();
+        if (!myArgs.dryRun && !myArgs.enumerate && myArgs.centralWriter && daemon) {
+            auto params = splitUriAndParams(settings.storeUri).second;
+            auto uri = daemon->getUri();
+            auto deferring = hasPrefix(uri, "unix://")
+                ? std::make_shared<DeferringStore>(std::string(uri, 7), params)
+                : std::make_shared<DeferringStore>(params);
+            deferringStore = deferring.get();
+            store = ref<Store>(deferring);
+        }
+
+        {
+            TraceSpan span("EvalState");
+            state.emplace(myArgs.searchPath, store);
+        }
+        if (dependencyLogger) dependencyLogger->store = &*state->store;
+        autoArgs = myArgs.getAutoArgs(*state);
+        vRoot = evaluateRoot(*state, *autoArgs);
+    } catch (std::exception & e) {
+        error = e.what();
+        // Don't forget to print it into the STDERR log, this is
+        // what's shown in the Hydra UI.
+        printError("error: %s", error);
+    }
+
+#if HAVE_BOEHMGC
+    /* Don't let every worker inherit the garbage. */
+    GC_gcollect();
+#endif
+
+    /* The files evaluated so far are shared by all workers; the master
+       gets them once, with the first worker. */
+    std::optional<nlohmann::json> rootFiles;
+    if (dependencyLogger) rootFiles = dependencyLogger->takeFiles();
+
+    /* If the system runs out of memory, have the kernel kill workers
+       first and the zygote before the master. */
+    setOOMScoreAdj(500);
+
+    /* Tell the master about workers that exit, so it can tell why a
+       worker died. */
+    sigset_t chldMask, oldMask;
+    sigemptyset(&chldMask);
+    sigaddset(&chldMask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chldMask, &oldMask) == -1)
+        throw SysError("blocking SIGCHLD");
+
+    AutoCloseFD sigFD = signalfd(-1, &chldMask, SFD_CLOEXEC);
+    if (!sigFD) throw SysError("creating signalfd");
+
+    while (true) {
+        struct pollfd pfds[2] = {
+            { .fd = control.get(), .events = POLLIN },
+            { .fd = sigFD.get(), .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("waiting for requests");
+        }
+
+        if (pfds[1].revents) {
+            struct signalfd_siginfo info;
+            if (read(sigFD.get(), &info, sizeof(info)) == -1)
+                throw SysError("reading signalfd");
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+                sendMessage(control.get(), nlohmann::json{{"exited", pid}, {"status", status}}.dump());
+        }
+
+        if (!pfds[0].revents) continue;
+
+        std::vector<AutoCloseFD> fds;
+        auto msg = *receiveMessage(control.get(), fds);
+        if (msg == "") break;
+        if (msg != "fork") abort();
+
+        if (error != "") {
+            nlohmann::json err;
+            err["error"] = error;
+            sendMessage(control.get(), err.dump());
+            continue;
+        }
+
+        Pipe toPipe, fromPipe;
+        toPipe.create();
+        fromPipe.create();
+
+        pid_t pid = fork();
+        if (pid == -1) throw SysError("forking worker process");
+
+        if (pid == 0) {
+            try {
+                control = -1;
+                sigFD = -1;
+                toPipe.writeSide = -1;
+                fromPipe.readSide = -1;
+                if (sigprocmask(SIG_SETMASK, &oldMask, nullptr) == -1)
+                    throw SysError("unblocking SIGCHLD");
+                if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+                    throw SysError("setting death signal");
+                setOOMScoreAdj(1000);
+                traceProcess("worker");
+#if HAVE_BOEHMGC
+                /* Make an attribute that allocates without bound fail
+                   with std::bad_alloc, rather than waiting until it's
+                   done to check how much memory we use. */
+                GC_set_max_heap_size(myArgs.maxHeapSize() * 1024 * 1024);
+#endif
+                dropInheritedConnections(*state->store);
+                AutoCloseFD to(std::move(fromPipe.writeSide));
+                AutoCloseFD from(std::move(toPipe.readSide));
+                try {
+                    worker(*state, *autoArgs, *vRoot, to, from);
+                } catch (std::exception & e) {
+                    nlohmann::json err;
+                    err["error"] = e.what();
+                    writeMessage(to.get(), err);
+                    // Don't forget to print it into the STDERR log, this is
+                    // what's shown in the Hydra UI.
+                    printError("error: %s", err["error"]);
+                }
+            } catch (std::exception & e) {
+                printError("error: %s", e.what());
+            }
+            _exit(0);
+        }
+
+        nlohmann::json reply{{"pid", pid}};
+        if (rootFiles) {
+            reply["files"] = std::move(*rootFiles);
+            rootFiles.reset();
+        }
+        sendMessage(control.get(), reply.dump(),
+            {toPipe.writeSide.get(), fromPipe.readSide.get()});
+    }
+}
+
+/* The master's handle on the zygote. The zygote is killed when this
+   goes out of scope; its workers follow because of their parent death
+   signal. */
+struct Zygote
+{
+    Pid pid;
+    AutoCloseFD control;
+
+    Zygote()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+            throw SysError("creating socket pair");
+        AutoCloseFD ours(fds[0]), theirs(fds[1]);
+
+        pid = startProcess(
+            [&]()
+            {
+                ours = -1;
+                zygote(theirs);
+            },
+            ProcessOptions { .allowVfork = false });
+
+        control = std::move(ours);
+    }
+
+    /* Exit statuses of workers, as reported by the zygote. */
+    std::map<pid_t, int> exitStatuses;
+
+    /* The source files the zygote evaluated, for --incremental. */
+    std::optional<nlohmann::json> rootFiles;
+
+    /* Start a worker process, returning its PID and the pipes to and
+       from it. */
+    pid_t forkWorker(AutoCloseFD & to, AutoCloseFD & from)
+    {
+        sendMessage(control.get(), "fork");
+
+        while (true) {
+            std::vector<AutoCloseFD> fds;
+            auto msg = *receiveMessage(control.get(), fds);
+            if (msg == "")
+                throw Error("zygote process exited unexpectedly");
+
+            auto json = nlohmann::json::parse(msg);
+
+            if (json.find("exited") != json.end()) {
+                exitStatuses[json["exited"]] = json["status"];
+                continue;
+            }
+
+            if (json.find("error") != json.end())
+                throw Error("worker error: %s", (std::string) json["error"]);
+
+            if (fds.size() != 2)
+                throw Error("zygote did not send the pipes of worker process %d", (pid_t) json["pid"]);
+
+            if (json.find("files") != json.end())
+                rootFiles = std::move(json["files"]);
+
+            to = std::move(fds[0]);
+            from = std::move(fds[1]);
+            return json["pid"];
+        }
+    }
+
+    /* Record the exit statuses the zygote has sent, without blocking. */
+    void receiveExitStatuses()
+    {
+        while (true) {
+            std::vector<AutoCloseFD> fds;
+            auto msg = receiveMessage(control.get(), fds, MSG_DONTWAIT);
+            if (!msg) break;
+            if (*msg == "")
+                throw Error("zygote process exited unexpectedly");
+            auto json = nlohmann::json::parse(*msg);
+            exitStatuses[json["exited"]] = json["status"];
+        }
+    }
+};
+
+/* Workers are handed batches of attributes sized so that evaluating a
+   batch takes about this many seconds, amortising the round trip over
+   many cheap attributes. */
+static const double targetBatchTime = 0.05;
+static const size_t maxBatchSize = 256;
+
+/* After this many workers in a row die without evaluating anything,
+   the evaluation is aborted. */
+static const size_t maxStartupFailures = 3;
+
+/* Per-attribute evaluation costs recorded with --history-file. They're
+   used on the next run to schedule expensive attributes first, so that
+   a long job doesn't end up alone at the tail of the evaluation. */
+struct History
+{
+    /* Time taken on the previous run by an attribute and everything
+       below it. */
+    std::map<std::string, double> expected;
+
+    /* Costs measured on this run. */
+    nlohmann::json measured = nlohmann::json::object();
+
+    void load(const Path & path)
+    {
+        if (!pathExists(path)) return;
+        for (auto & [attrPath, cost] : nlohmann::json::parse(readFile(path)).items()) {
+            double time = cost["time"];
+            /* Charge the time to the attribute and its ancestors. */
+            std::string prefix = attrPath;
+            while (true) {
+                expected[prefix] += time;
+                if (prefix.empty()) break;
+                auto dot = prefix.rfind('.');
+                prefix = dot == std::string::npos ? "" : std::string(prefix, 0, dot);
+            }
+        }
+    }
+
+    void save(const Path & path)
+    {
+        Path tmp = path + ".tmp";
+        writeFile(tmp, measured.dump());
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    }
+
+    double expectedCost(const std::string & attrPath) const
+    {
+        auto i = expected.find(attrPath);
+        return i == expected.end() ? 0 : i->second;
+    }
+};
+
+/* An attribute waiting to be evaluated. The most expensive ones come
+   first; ties (including everything without a history) are broken by
+   name. */
+struct Todo
+{
+    double cost;
+    std::string attrPath;
+
+    bool operator < (const Todo & other) const
+    {
+        if (cost != other.cost) return cost > other.cost;
+        return attrPath < other.attrPath;
+    }
+};
+
+/* With --stream, print a job as a single line as soon as it's known,
+   so consumers can start on it before the evaluation finishes. */
+static void printJob(const nlohmann::json & job)
+{
+    static std::mutex lock;
+    std::lock_guard<std::mutex> guard(lock);
+    std::cout << job.dump() << "\n" << std::flush;
+}
+
+/* Writes the derivations that workers deferred, on a connection of its
+   own in a thread of the master. Each batch costs one query for the
+   paths that are already valid, then one write per missing derivation,
+   in the order they were instantiated so references come first.
+   Derivations that several workers instantiated are written once.
+   Whatever refers to the derivations, i.e. jobs printed with --stream,
+   checkpoint lines and GC roots, is done by this thread after they
+   have been written. */
+class DerivationWriter
+{
+    struct Item
+    {
+        nlohmann::json drvs;
+        std::function<void()> then;
+    };
+
+    struct State
+    {
+        std::vector<Item> queue;
+        bool quit = false;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Only used by the thread. */
+    std::set<std::string> written;
+
+    std::thread thread;
+
+public:
+
+    size_t nrWritten = 0, nrValid = 0;
+    double writeTime = 0;
+
+    /* The thread isn't started by the constructor, so that the master
+       can fork the zygote first. */
+    void start()
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~DerivationWriter()
+    {
+        if (thread.joinable()) {
+            state_.lock()->quit = true;
+            wakeup.notify_one();
+            thread.join();
+        }
+    }
+
+    void add(nlohmann::json drvs)
+    {
+        state_.lock()->queue.push_back({std::move(drvs), {}});
+        wakeup.notify_one();
+    }
+
+    /* Run an action once the derivations added so far have been
+       written. Actions run in the order they were added. */
+    void after(std::function<void()> action)
+    {
+        state_.lock()->queue.push_back({nlohmann::json::array(), std::move(action)});
+        wakeup.notify_one();
+    }
+
+    /* Wait until all queued derivations have been written. */
+    void finish()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_one();
+        thread.join();
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+    }
+
+private:
+
+    void run()
+    {
+        try {
+            auto store = openStore();
+
+            while (true) {
+                std::vector<Item> batch;
+
+                {
+                    auto state(state_.lock());
+                    while (state->queue.empty() && !state->quit)
+                        state.wait(wakeup);
+                    if (state->queue.empty()) break;
+                    std::swap(batch, state->queue);
+                }
+
+                auto startTime = std::chrono::steady_clock::now();
+                TraceSpan span("write derivations");
+
+                std::vector<nlohmann::json *> drvs;
+                StorePathSet paths;
+                for (auto & item : batch)
+                    for (auto & drv : item.drvs)
+                        if (written.insert(drv["path"]).second) {
+                            drvs.push_back(&drv);
+                            paths.insert(store->parseStorePath((std::string) drv["path"]));
+                        }
+
+                auto valid = store->queryValidPaths(paths);
+
+                for (auto drv : drvs) {
+                    auto path = store->parseStorePath((std::string) (*drv)["path"]);
+                    if (valid.count(path)) {
+                        nrValid++;
+                        continue;
+                    }
+                    StorePathSet references;
+                    for (auto & i : (*drv)["references"])
+                        references.insert(store->parseStorePath((std::string) i));
+                    store->addTextToStore((*drv)["name"], (*drv)["contents"], references);
+                    nrWritten++;
+                }
+
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+                writeTime += elapsed.count();
+                span.args["written"] = drvs.size();
+
+                for (auto & item : batch)
+                    if (item.then) item.then();
+            }
+        } catch (...) {
+            state_.lock()->exc = std::current_exception();
+        }
+    }
+};
+
+/* Registers the derivations of jobs as GC roots in --gc-roots-dir. It
+   runs in a thread of its own in the master, so that neither the
+   workers nor the event loop wait for the store, and it only creates
+   each root once. */
+class GcRootWriter
+{
+    struct State
+    {
+        std::vector<std::string> queue;
+        bool quit = false;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Base names of the roots that exist. Only used by the thread. */
+    std::set<std::string> roots;
+
+    std::thread thread;
+
+public:
+
+    GcRootWriter()
+    {
+        /* One readdir() here replaces a stat() per job. */
+        if (pathExists(gcRootsDir))
+            for (auto & entry : readDirectory(gcRootsDir))
+                roots.insert(entry.name);
+    }
+
+    void start()
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~GcRootWriter()
+    {
+        if (thread.joinable()) {
+            state_.lock()->quit = true;
+            wakeup.notify_one();
+            thread.join();
+        }
+    }
+
+    void add(const std::string & drvPath)
+    {
+        state_.lock()->queue.push_back(drvPath);
+        wakeup.notify_one();
+    }
+
+    /* Wait until all queued roots have been registered. */
+    void finish()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_one();
+        thread.join();
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+    }
+
+private:
+
+    void run()
+    {
+        try {
+            auto localStore = openStore().dynamic_pointer_cast<LocalFSStore>();
+
+            while (true) {
+                std::vector<std::string> batch;
+
+                {
+                    auto state(state_.lock());
+                    while (state->queue.empty() && !state->quit)
+                        state.wait(wakeup);
+                    if (state->queue.empty()) break;
+                    std::swap(batch, state->queue);
+                }
+
+                if (!localStore) continue;
+
+                TraceSpan span("register GC roots", {{"count", batch.size()}});
+
+                for (auto & drvPath : batch) {
+                    std::string name(baseNameOf(drvPath));
+                    if (!roots.insert(name).second) continue;
+                    localStore->addPermRoot(localStore->parseStorePath(drvPath), gcRootsDir + "/" + name);
+                }
+            }
+        } catch (...) {
+            state_.lock()->exc = std::current_exception();
+        }
+    }
+};
+
+/* A worker process, as seen by the master. */
+struct Worker
+{
+    pid_t pid = -1;
+    AutoCloseFD to, from;
+
+    MessageReader reader;
+
+    /* Whether the worker has asked for work and is waiting for it. */
+    bool idle = false;
+
+    /* Whether the worker has been told to exit. */
+    bool done = false;
+
+    /* Whether the worker's pipe was closed and we're waiting for the
+       zygote to tell us how it exited. */
+    bool exited = false;
+
+    /* Number of attributes the process has evaluated. */
+    size_t nrDone = 0;
+
+    /* The index in the batch of the attribute being evaluated, when it
+       has to be done, and whether the worker was killed for missing
+       it. */
+    size_t current = 0;
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    bool timedOut = false;
+
+    /* The process's chain of source files for --incremental, following
+       the zygote's. */
+    int64_t chain = -1;
+    size_t chainLength = 0;
+
+    /* The batch the worker is evaluating. */
+    std::vector<std::string> attrPaths;
+    std::chrono::steady_clock::time_point batchStart;
+
+    /* Size of the next batch, adapted to the measured time per
+       attribute. */
+    size_t batchSize = 1;
+    double attrTime = 0;
+
+    /* Attributes discovered by this worker. It has their parent cached,
+       so it gets them first; other workers only take them when they'd
+       be idle otherwise. */
+    std::set<Todo> local;
+};
+
+/* Whether a cached reply can be used: its derivation may have been
+   garbage-collected since. */
+static bool isReplayable(Store & store, const nlohmann::json & reply)
+{
+    return reply.find("job") == reply.end()
+        || myArgs.dryRun
+        || myArgs.enumerate
+        || store.isValidPath(store.parseStorePath((std::string) reply["job"]["drvPath"]));
+}
+
+/* How long the caches keep the results of inputs that haven't been
+   evaluated again. */
+static const int64_t cacheRetention = 30 * 24 * 60 * 60;
+
+/* Mark the key of this run as used, and delete the rows of the given
+   tables for keys that haven't been used for cacheRetention, so that
+   the databases don't keep growing. */
+static void evictKeys(SQLite & db, const std::string & key, const std::vector<std::string> & tables)
+{
+    db.exec(R"(
+        create table if not exists Keys (
+            key      text primary key not null,
+            lastUsed integer not null
+        );
+    )");
+
+    int64_t now = time(0);
+
+    SQLiteStmt touch;
+    touch.create(db, "insert or replace into Keys(key, lastUsed) values (?, ?)");
+    touch.use()(key)(now).exec();
+
+    for (auto & table : tables) {
+        SQLiteStmt evict;
+        evict.create(db, fmt("delete from %s where key not in (select key from Keys where lastUsed >= ?)", table));
+        evict.use()(now - cacheRetention).exec();
+    }
+
+    SQLiteStmt evict;
+    evict.create(db, "delete from Keys where lastUsed < ?");
+    evict.use()(now - cacheRetention).exec();
+}
+
+/* Replies from earlier evaluations of the same inputs, stored in
+   SQLite and keyed by a hash of the inputs. Errors aren't cached, since
+   they may be transient, e.g. a failed download. */
+struct ResultCache
+{
+    SQLite db;
+    SQLiteStmt insertReply, lookupReply;
+    std::string key;
+    ref<Store> store;
+
+    ResultCache(const std::string & key, ref<Store> store)
+        : key(key)
+        , store(store)
+    {
+        auto dbDir = getCacheDir() + "/hydra-eval-jobs";
+        createDirs(dbDir);
+
+        db = SQLite(dbDir + "/results.sqlite");
+        db.isCache();
+
+        db.exec(R"(
+            create table if not exists Results (
+                key     text not null,
+                attr    text not null,
+                reply   text not null,
+                primary key (key, attr)
+            );
+        )");
+
+        evictKeys(db, key, {"Results"});
+
+        insertReply.create(db, "insert or replace into Results(key, attr, reply) values (?, ?, ?)");
+        lookupReply.create(db, "select reply from Results where key = ? and attr = ?");
+    }
+
+    void insert(const std::string & attrPath, const nlohmann::json & reply)
+    {
+        if (reply.find("error") != reply.end()) return;
+        insertReply.use()(key)(attrPath)(reply.dump()).exec();
+    }
+
+    std::optional<nlohmann::json> lookup(const std::string & attrPath)
+    {
+        auto query(lookupReply.use()(key)(attrPath));
+        if (!query.next()) return {};
+
+        auto reply = nlohmann::json::parse(query.getStr(0));
+        if (!isReplayable(*store, reply)) return {};
+
+        return reply;
+    }
+};
+
+/* For --incremental, the replies of earlier evaluations along with the
+   source files they may have depended on, keyed by a hash of the inputs
+   other than the main source.
+
+   Each worker process has a chain of the files it evaluated, in order.
+   Since the evaluator doesn't load a file twice, an attribute depends on
+   all files in its worker's chain up to the point where it was
+   evaluated. The files the zygote evaluated before forking are stored
+   once, as the parent chain of all workers' chains. On startup, we find
+   for each chain how many files are unchanged, and replay the
+   attributes within that prefix. */
+struct DependencyTracker
+{
+    SQLite db;
+    SQLiteStmt insertFile, insertChain, insertAttr, lookupAttr;
+    std::string key;
+    ref<Store> store;
+
+    /* Per chain of an earlier run, the number of files, the number of
+       unchanged files, and the parent chain it follows, if any. */
+    std::map<int64_t, int64_t> chainLengths, unchangedFiles, parents;
+
+    int64_t nextChain = 1;
+
+    DependencyTracker(const std::string & key, ref<Store> store)
+        : key(key)
+        , store(store)
+    {
+        auto dbDir = getCacheDir() + "/hydra-eval-jobs";
+        createDirs(dbDir);
+
+        db = SQLite(dbDir + "/dependencies.sqlite");
+        db.isCache();
+
+        db.exec(R"(
+            create table if not exists Files (
+                key     text not null,
+                chain   integer not null,
+                seq     integer not null,
+                path    text not null,
+                hash    text not null,
+                primary key (key, chain, seq)
+            );
+
+            create table if not exists Chains (
+                key     text not null,
+                chain   integer primary key not null,
+                parent  integer not null
+            );
+
+            create table if not exists Attrs (
+                key     text not null,
+                attr    text not null,
+                chain   integer not null,
+                nrFiles integer not null,
+                reply   text not null,
+                primary key (key, attr)
+            );
+        )");
+
+        evictKeys(db, key, {"Attrs"});
+
+        db.exec(R"(
+            delete from Files where not exists
+                (select 1 from Attrs where Attrs.key = Files.key and (Attrs.chain = Files.chain
+                    or Attrs.chain in (select chain from Chains where parent = Files.chain)));
+
+            delete from Chains where not exists
+                (select 1 from Attrs where Attrs.key = Chains.key and Attrs.chain = Chains.chain);
+        )");
+
+        insertFile.create(db, "insert or replace into Files(key, chain, seq, path, hash) values (?, ?, ?, ?, ?)");
+        insertChain.create(db, "insert or replace into Chains(key, chain, parent) values (?, ?, ?)");
+        insertAttr.create(db, "insert or replace into Attrs(key, attr, chain, nrFiles, reply) values (?, ?, ?, ?, ?)");
+        lookupAttr.create(db, "select chain, nrFiles, reply from Attrs where key = ? and attr = ?");
+
+        SQLiteStmt maxChain;
+        maxChain.create(db, "select max(chain) from (select chain from Files union all select chain from Chains union all select chain from Attrs)");
+        auto queryMax(maxChain.use());
+        if (queryMax.next() && !queryMax.isNull(0))
+            nextChain = queryMax.getInt(0) + 1;
+
+        SQLiteStmt queryFiles;
+        queryFiles.create(db, "select chain, seq, path, hash from Files where key = ? order by chain, seq");
+        auto query(queryFiles.use()(key));
+
+        std::map<std::pair<std::string, std::string>, bool> checked;
+        std::set<int64_t> changedChains;
+
+        while (query.next()) {
+            auto chain = query.getInt(0);
+            chainLengths[chain] = query.getInt(1) + 1;
+            if (changedChains.count(chain)) continue;
+            auto file = std::make_pair(query.getStr(2), query.getStr(3));
+            auto i = checked.find(file);
+            if (i == checked.end())
+                i = checked.emplace(file, isUnchanged(file.first, file.second)).first;
+            if (i->second)
+                unchangedFiles[chain] = query.getInt(1) + 1;
+            else
+                changedChains.insert(chain);
+        }
+
+        SQLiteStmt queryChains;
+        queryChains.create(db, "select chain, parent from Chains where key = ?");
+        auto queryParents(queryChains.use()(key));
+        while (queryParents.next())
+            parents[queryParents.getInt(0)] = queryParents.getInt(1);
+    }
+
+    bool isUnchanged(const std::string & path, const std::string & hash)
+    {
+        if (hash == "") return true;
+
+        /* The main source as a whole is identified by its store path. */
+        if (path == "<source>") return hash == mainSource;
+
+        auto actualPath = hasPrefix(path, "<source>")
+            ? mainSource + path.substr(8)
+            : path;
+
+        try {
+            if (store->isInStore(hash))
+                return store->printStorePath(store->computeStorePathForPath(
+                    std::string(baseNameOf(actualPath)), actualPath).first) == hash;
+            return hashFile(htSHA256, actualPath).to_string(Base32, false) == hash;
+        } catch (Error &) {
+            return false;
+        }
+    }
+
+    /* Start the chain of a new worker process, following the chain of
+       the zygote's files, if any. */
+    int64_t newChain(int64_t parent = -1)
+    {
+        auto chain = nextChain++;
+        if (parent != -1)
+            insertChain.use()(key)(chain)(parent).exec();
+        return chain;
+    }
+
+    void addFiles(int64_t chain, size_t & chainLength, const nlohmann::json & files)
+    {
+        for (auto & file : files)
+            insertFile.use()(key)(chain)(chainLength++)(file[0].get<std::string>())(file[1].get<std::string>()).exec();
+    }
+
+    void insert(const std::string & attrPath, int64_t chain, size_t chainLength, const nlohmann::json & reply)
+    {
+        if (reply.find("error") != reply.end()) return;
+        insertAttr.use()(key)(attrPath)(chain)(chainLength)(reply.dump()).exec();
+    }
+
+    std::optional<nlohmann::json> lookup(const std::string & attrPath)
+    {
+        auto query(lookupAttr.use()(key)(attrPath));
+        if (!query.next()) return {};
+
+        auto chain = query.getInt(0);
+        auto nrFiles = query.getInt(1);
+        if (nrFiles > 0 && unchangedPrefix(chain) < nrFiles) return {};
+
+        auto reply = nlohmann::json::parse(query.getStr(2));
+        if (!isReplayable(*store, reply)) return {};
+
+        return reply;
+    }
+
+private:
+
+    /* The number of unchanged files at the start of a chain, counting
+       those of its parent. */
+    int64_t unchangedPrefix(int64_t chain)
+    {
+        auto i = parents.find(chain);
+        if (i == parents.end()) return unchangedFiles[chain];
+        auto parentLength = chainLengths[i->second];
+        if (unchangedFiles[i->second] < parentLength) return unchangedFiles[i->second];
+        return parentLength + unchangedFiles[chain];
+    }
+};
+
+/* Print a value for a cache key, forcing it only as far as it's
+   printed, and giving up after a number of values: an argument like
+   `import <nixpkgs> {}` is far too large to force completely. Functions
+   can't be printed faithfully, so they make the value unusable too. */
+static bool printKeyValue(EvalState & state, Value & v, std::ostream & str, size_t & budget)
+{
+    if (budget == 0) return false;
+    budget--;
+
+    state.forceValue(v);
+
+    switch (v.type) {
+        case tAttrs:
+            str << "{ ";
+            for (auto & i : v.attrs->lexicographicOrder()) {
+                str << (std::string) i->name << " = ";
+                if (!printKeyValue(state, *i->value, str, budget)) return false;
+                str << "; ";
+            }
+            str << "}";
+            return true;
+        case tList1:
+        case tList2:
+        case tListN:
+            str << "[ ";
+            for (size_t n = 0; n < v.listSize(); n++) {
+                if (!printKeyValue(state, *v.listElems()[n], str, budget)) return false;
+                str << " ";
+            }
+            str << "]";
+            return true;
+        case tLambda:
+        case tPrimOp:
+        case tPrimOpApp:
+        case tExternal:
+            return false;
+        default:
+            str << v;
+            return true;
+    }
+}
+
+/* The auto arguments for a cache key, unless one of them can't be
+   printed. */
+static std::optional<std::string> printAutoArgs(EvalState & state)
+{
+    std::string res;
+    for (auto & arg : myArgs.getAutoArgs(state)->lexicographicOrder()) {
+        std::ostringstream str;
+        size_t budget = 10000;
+        try {
+            if (!printKeyValue(state, *arg->value, str, budget)) return {};
+        } catch (Error &) {
+            return {};
+        }
+        res += "\n" + (std::string) arg->name + "=" + str.str();
+    }
+    return res;
+}
+
+/* Hash the inputs of the evaluation, if they're immutable: the locked
+   flake, or a release expression and search path in the store with the
+   auto arguments, if those can be printed. */
+static std::optional<std::string> getCacheKey(EvalState & state)
+{
+    std::string key;
+
+    if (lockedFlake)
+        key = "flake:" + lockedFlake->getFingerprint().to_string(Base16, false);
+
+    else {
+        auto expr = absPath(myArgs.releaseExpr);
+        if (!state.store->isInStore(expr)) return {};
+        key = "expr:" + expr + "\n" + settings.thisSystem.get();
+
+        for (auto & i : getSearchPath()) {
+            auto eq = i.find('=');
+            if (!state.store->isInStore(eq == std::string::npos ? i : i.substr(eq + 1))) return {};
+            key += "\n" + i;
+        }
+
+        auto autoArgs = printAutoArgs(state);
+        if (!autoArgs) return {};
+        key += *autoArgs;
+    }
+
+    /* Cached jobs only have the fields that were asked for. */
+    key += "\nfields:" + concatStringsSep(",", myArgs.jobFields) + (myArgs.enumerate ? ",enumerate" : "");
+
+    return hashString(htSHA256, key).to_string(Base16, false);
+}
+
+/* Like getCacheKey(), but with the main source abstracted away, so
+   that the key is the same for another revision of it. */
+static std::optional<std::string> getReplayKey(EvalState & state)
+{
+    std::string key;
+
+    if (lockedFlake)
+        key = "flake:" + lockedFlake->lockFile.to_string();
+
+    else {
+        key = "expr:" + absPath(myArgs.releaseExpr) + "\n" + settings.thisSystem.get();
+        for (auto & i : getSearchPath())
+            key += "\n" + i;
+        auto autoArgs = printAutoArgs(state);
+        if (!autoArgs) return {};
+        key += *autoArgs;
+    }
+
+    if (mainSource != "")
+        key = replaceStrings(key, mainSource, "<source>");
+
+    key += "\nfields:" + concatStringsSep(",", myArgs.jobFields) + (myArgs.enumerate ? ",enumerate" : "");
+
+    return hashString(htSHA256, key).to_string(Base16, false);
+}
+
+/* Hash what a checkpoint's results depend on, so that an evaluation
+   isn't resumed against different inputs: the locked flake, or the
+   contents of the release expression (though not of the files it
+   imports) with the search path, system and auto arguments. */
+static std::string getInputsHash(EvalState & state)
+{
+    std::string key;
+
+    if (lockedFlake)
+        key = "flake:" + lockedFlake->getFingerprint().to_string(Base16, false);
+
+    else {
+        auto expr = absPath(myArgs.releaseExpr);
+        if (pathExists(expr + "/default.nix")) expr += "/default.nix";
+        key = "expr:" + expr + "\n" + settings.thisSystem.get();
+        if (pathExists(expr))
+            key += "\n" + hashFile(htSHA256, expr).to_string(Base16, false);
+        for (auto & i : getSearchPath())
+            key += "\n" + i;
+        key += printAutoArgs(state).value_or("\n<unprintable arguments>");
+    }
+
+    key += "\nfields:" + concatStringsSep(",", myArgs.jobFields) + (myArgs.enumerate ? ",enumerate" : "");
+
+    return hashString(htSHA256, key).to_string(Base16, false);
+}
+
+/* A worker process that has been started but not yet given a slot. */
+struct SpareWorker
+{
+    pid_t pid;
+    AutoCloseFD to, from;
+};
+
+/* The master hands out attributes to the workers and collects the
+   results. It multiplexes all workers from a single thread, so the
+   queues need no locking. */
+struct Master
+{
+    History & history;
+    ResultCache * cache;
+    DependencyTracker * tracker;
+
+    /* The hash of the inputs, recorded in the checkpoint file. */
+    std::string inputs;
+
+    /* Started once there's something the cache can't answer. */
+    std::unique_ptr<Zygote> zygote;
+
+    /* The chain of the zygote's source files for --incremental, which
+       the chains of all workers follow. */
+    int64_t rootChain = -1;
+    size_t rootChainLength = 0;
+
+    AutoCloseFD epollFD;
+    std::vector<Worker> workers;
+
+    /* Processes ready to replace workers that restart, so that a
+       restart doesn't wait for a fork. */
+    std::list<SpareWorker> spares;
+
+    /* Attributes that any worker may evaluate. */
+    std::set<Todo> todo;
+
+    std::set<std::string> active;
+
+    /* Attributes that were being evaluated when a worker died. They are
+       retried one at a time in fresh workers to find the culprit. */
+    std::set<std::string> suspects;
+
+    /* Workers that died before evaluating anything, since the last one
+       that did evaluate something. */
+    size_t nrStartupFailures = 0;
+
+    nlohmann::json jobs;
+    size_t nrAttrs = 0;
+    size_t nrRestarts = 0;
+
+    std::unique_ptr<GcRootWriter> gcRootWriter;
+    std::unique_ptr<DerivationWriter> derivationWriter;
+
+    /* The checkpoint file gets a line for every completed attribute. */
+    AutoCloseFD checkpointFD;
+
+    /* The stats file gets a line for every evaluated attribute. */
+    AutoCloseFD statsFD;
+    size_t nrResumed = 0;
+    size_t nrCached = 0;
+    size_t nrReplayed = 0;
+    size_t nrJobs = 0;
+    size_t nrErrors = 0;
+
+    /* Time spent waiting for the zygote to fork workers, including
+       its evaluation of the root. */
+    double startupTime = 0;
+
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    Master(History & history, ResultCache * cache, DependencyTracker * tracker, const std::string & inputs)
+        : history(history)
+        , cache(cache)
+        , tracker(tracker)
+        , inputs(inputs)
+        , workers(myArgs.nrWorkers)
+    {
+        epollFD = epoll_create1(EPOLL_CLOEXEC);
+        if (!epollFD) throw SysError("creating epoll instance");
+
+        if (gcRootsDir != "" && !myArgs.dryRun)
+            gcRootWriter = std::make_unique<GcRootWriter>();
+
+        if (!myArgs.dryRun && !myArgs.enumerate && myArgs.centralWriter)
+            derivationWriter = std::make_unique<DerivationWriter>();
+
+        if (statsFile != "") {
+            statsFD = open(statsFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            if (!statsFD) throw SysError("creating '%s'", statsFile);
+        }
+
+        if (myArgs.resume && checkpointFile != "" && pathExists(checkpointFile))
+            resume();
+        else {
+            if (checkpointFile != "") {
+                checkpointFD = open(checkpointFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                if (!checkpointFD) throw SysError("creating '%s'", checkpointFile);
+                writeFull(checkpointFD.get(), nlohmann::json{{"expr", myArgs.releaseExpr}, {"inputs", inputs}}.dump() + "\n");
+            }
+            enqueue(todo, "");
+        }
+    }
+
+    void run()
+    {
+        /* Fork the zygote before starting the writer threads, so that
+           it doesn't inherit a copy of the process with their store
+           connections and locks in an arbitrary state. Results queued
+           for the writers in the meantime wait for them. */
+        if (nrPending() > 0)
+            zygote = std::make_unique<Zygote>();
+
+        if (derivationWriter) derivationWriter->start();
+        if (gcRootWriter) gcRootWriter->start();
+
+        if (!zygote) {
+            finish();
+            return;
+        }
+
+        for (auto & worker : workers)
+            startWorker(worker);
+
+        /* The zygote tells us when workers exit. */
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = workers.size();
+        if (epoll_ctl(epollFD.get(), EPOLL_CTL_ADD, zygote->control.get(), &event) == -1)
+            throw SysError("adding zygote to epoll instance");
+
+        std::vector<struct epoll_event> events(workers.size() + 1);
+
+        auto nextMetrics = std::chrono::steady_clock::now();
+
+        while (std::any_of(workers.begin(), workers.end(), [](const Worker & w) { return !w.done; })) {
+            checkInterrupt();
+
+            if (metricsFile != "" && std::chrono::steady_clock::now() >= nextMetrics) {
+                writeMetrics();
+                nextMetrics = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            }
+
+            int n = [&]() {
+                TraceSpan span("wait for workers");
+                return epoll_wait(epollFD.get(), events.data(), events.size(), 1000);
+            }();
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for workers");
+            }
+
+            for (int i = 0; i < n; i++) {
+                auto idx = events[i].data.u64;
+                if (idx == workers.size())
+                    zygote->receiveExitStatuses();
+                else
+                    readFrom(workers[idx]);
+            }
+
+            reapWorkers();
+
+            killStuckWorkers();
+
+            /* Give work to idle workers, or tell them to exit if
+               there's nothing left. */
+            for (auto & worker : workers)
+                if (worker.idle) assignWork(worker);
+
+            /* Replenish the spares after handing out work, one per
+               round, so that forking them doesn't delay anything. */
+            if (spares.size() < myArgs.nrSpareWorkers && nrPending() > 0) {
+                SpareWorker spare;
+                spare.pid = forkWorker(spare.to, spare.from);
+                debug("created spare worker process %d", spare.pid);
+                spares.push_back(std::move(spare));
+            }
+        }
+
+        for (auto & spare : spares)
+            writeMessage(spare.to.get(), "exit");
+
+        finish();
+    }
+
+private:
+
+    void finish()
+    {
+        if (derivationWriter) derivationWriter->finish();
+        if (gcRootWriter) gcRootWriter->finish();
+        if (metricsFile != "") writeMetrics();
+    }
+
+    pid_t forkWorker(AutoCloseFD & to, AutoCloseFD & from)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto pid = zygote->forkWorker(to, from);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        startupTime += elapsed.count();
+
+        if (tracker && rootChain == -1 && zygote->rootFiles) {
+            SQLiteTxn txn(tracker->db);
+            rootChain = tracker->newChain();
+            tracker->addFiles(rootChain, rootChainLength, *zygote->rootFiles);
+            txn.commit();
+        }
+
+        return pid;
+    }
+
+    /* Replace --metrics-file with the current metrics. It's written to a
+       temporary file first, so that readers never see half of it. */
+    void writeMetrics()
+    {
+        std::string out;
+
+        auto metric = [&](const std::string & name, const std::string & type, const std::string & help, nlohmann::json value) {
+            out += fmt("# HELP hydra_eval_jobs_%s %s\n", name, help);
+            out += fmt("# TYPE hydra_eval_jobs_%s %s\n", name, type);
+            out += fmt("hydra_eval_jobs_%s%s %s\n", name, type == "counter" ? "_total" : "", value.dump());
+        };
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+
+        metric("pending_attributes", "gauge", "Attributes waiting to be evaluated.", nrPending());
+        metric("active_attributes", "gauge", "Attributes being evaluated.", active.size());
+        metric("evaluated_attributes", "counter", "Attributes evaluated by workers.", nrAttrs);
+        metric("cached_attributes", "counter", "Attributes found in the result cache or replayed.", nrCached + nrReplayed);
+        metric("jobs", "counter", "Jobs found.", nrJobs);
+        metric("errors", "counter", "Attributes that failed to evaluate.", nrErrors);
+        metric("attributes_per_second", "gauge", "Attributes evaluated per second since the start.",
+            elapsed.count() > 0 ? nrAttrs / elapsed.count() : 0);
+        metric("worker_restarts", "counter", "Workers restarted for exceeding the memory limit.", nrRestarts);
+        metric("worker_startup_seconds", "counter", "Time spent waiting for workers to be forked.", startupTime);
+        metric("elapsed_seconds", "gauge", "Time since the evaluation started.", elapsed.count());
+
+        out += "# HELP hydra_eval_jobs_worker_rss_bytes Resident set size of each worker.\n";
+        out += "# TYPE hydra_eval_jobs_worker_rss_bytes gauge\n";
+        for (auto & worker : workers) {
+            if (worker.pid == -1) continue;
+            try {
+                out += fmt("hydra_eval_jobs_worker_rss_bytes{worker=\"%d\"} %d\n",
+                    &worker - workers.data(), getCurrentRSS(std::to_string(worker.pid)));
+            } catch (SysError &) {
+                /* The worker just exited. */
+            }
+        }
+
+        out += "# EOF\n";
+
+        /* Exporting metrics is best-effort; don't let a full disk
+           abort the evaluation. */
+        try {
+            auto tmp = metricsFile + ".tmp";
+            writeFile(tmp, out);
+            if (rename(tmp.c_str(), metricsFile.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmp, metricsFile);
+        } catch (Error & e) {
+            printError("error: cannot write metrics: %s", e.msg());
+        }
+    }
+
+    size_t nrPending()
+    {
+        size_t n = todo.size();
+        for (auto & worker : workers)
+            n += worker.local.size();
+        return n;
+    }
+
+    void startWorker(Worker & worker)
+    {
+        if (spares.empty()) {
+            worker.pid = forkWorker(worker.to, worker.from);
+            debug("created worker process %d", worker.pid);
+        } else {
+            auto & spare = spares.front();
+            worker.pid = spare.pid;
+            worker.to = std::move(spare.to);
+            worker.from = std::move(spare.from);
+            spares.pop_front();
+            debug("using spare worker process %d", worker.pid);
+        }
+
+        worker.reader = MessageReader(worker.from.get());
+        worker.idle = false;
+        worker.exited = false;
+        worker.nrDone = 0;
+        worker.timedOut = false;
+        worker.chain = tracker ? tracker->newChain(rootChain) : -1;
+        worker.chainLength = 0;
+
+        if (fcntl(worker.from.get(), F_SETFL, O_NONBLOCK) == -1)
+            throw SysError("making worker pipe non-blocking");
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = &worker - workers.data();
+        if (epoll_ctl(epollFD.get(), EPOLL_CTL_ADD, worker.from.get(), &event) == -1)
+            throw SysError("adding worker to epoll instance");
+    }
+
+    void readFrom(Worker & worker)
+    {
+        if (!worker.reader.fill()) {
+            /* Closing the pipe removes it from the epoll instance. */
+            worker.to = -1;
+            worker.from = -1;
+            worker.idle = false;
+            if (worker.done)
+                worker.pid = -1;
+            else
+                worker.exited = true;
+            return;
+        }
+
+        while (auto msg = worker.reader.next())
+            handleMessage(worker, *msg);
+    }
+
+    void handleMessage(Worker & worker, nlohmann::json & msg)
+    {
+        if (msg == "next") {
+            worker.idle = true;
+            return;
+        }
+
+        /* The worker starts on the next attribute of its batch. */
+        if (msg.is_object() && msg.find("start") != msg.end()) {
+            worker.current = msg["start"];
+            worker.deadline = std::chrono::steady_clock::now() + std::chrono::seconds(myArgs.attrTimeout);
+            return;
+        }
+
+        /* The attribute being evaluated asks for more time. */
+        if (msg.is_object() && msg.find("timeout") != msg.end()) {
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds((long) msg["timeout"]);
+            if (worker.deadline && *worker.deadline < deadline)
+                worker.deadline = deadline;
+            return;
+        }
+
+        if (msg == "restart") {
+            if (worker.done) return;
+            nrRestarts++;
+            traceInstant("restart", {{"pid", worker.pid}});
+            restartWorker(worker);
+            return;
+        }
+
+        if (worker.attrPaths.empty() || !msg.is_array())
+            throw Error("worker error: %s", (std::string) msg["error"]);
+
+        handleReplies(worker, msg);
+    }
+
+    /* Replace the worker's process by a fresh one. */
+    void restartWorker(Worker & worker)
+    {
+        /* Closing the pipe removes it from the epoll instance. */
+        worker.to = -1;
+        worker.from = -1;
+        worker.pid = -1;
+        /* The new process won't have anything cached, so let any
+           worker have our attributes. */
+        todo.merge(worker.local);
+        startWorker(worker);
+    }
+
+    /* Handle workers that died, once the zygote has told us how. */
+    void reapWorkers()
+    {
+        for (auto & worker : workers) {
+            if (!worker.exited) continue;
+
+            auto status = zygote->exitStatuses.find(worker.pid);
+            if (status == zygote->exitStatuses.end()) continue;
+
+            /* Workers are the kernel's first pick when the system runs
+               out of memory, so that's the likely reason for a
+               SIGKILL, unless it was us. */
+            auto error =
+                worker.timedOut ? "timeout" :
+                WIFSIGNALED(status->second) && WTERMSIG(status->second) == SIGKILL ? "out of memory" :
+                fmt("worker process %d %s", worker.pid, statusToString(status->second));
+
+            /* A worker that dies before doing anything will likely do
+               so again, unless it was killed, e.g. by the kernel when
+               memory ran out. */
+            if (worker.attrPaths.empty() && worker.nrDone == 0
+                && !(WIFSIGNALED(status->second) && WTERMSIG(status->second) == SIGKILL)
+                && ++nrStartupFailures >= maxStartupFailures)
+                throw Error("%s", error);
+
+            printError("error: %s", error);
+
+            /* Time is measured per attribute, so the one that was being
+               evaluated is to blame, even in a worker that isn't
+               fresh. The rest of the batch is evaluated again. */
+            if (worker.timedOut && worker.current < worker.attrPaths.size()) {
+                auto culprit = worker.attrPaths[worker.current];
+                for (auto & attrPath : worker.attrPaths)
+                    if (attrPath != culprit) {
+                        active.erase(attrPath);
+                        todo.insert({history.expectedCost(attrPath), attrPath});
+                    }
+                worker.attrPaths = {culprit};
+            }
+
+            if (!worker.attrPaths.empty())
+                batchFailed(worker, error, worker.timedOut);
+            restartWorker(worker);
+        }
+
+        /* Forget the statuses of processes that are no longer our
+           workers or spares, e.g. ones that exited normally. */
+        for (auto i = zygote->exitStatuses.begin(); i != zygote->exitStatuses.end(); )
+            if (std::any_of(workers.begin(), workers.end(), [&](const Worker & w) { return w.pid == i->first; })
+                || std::any_of(spares.begin(), spares.end(), [&](const SpareWorker & w) { return w.pid == i->first; }))
+                ++i;
+            else
+                i = zygote->exitStatuses.erase(i);
+    }
+
+    /* Kill workers that have been evaluating an attribute for longer
+       than --attr-timeout. */
+    void killStuckWorkers()
+    {
+        auto now = std::chrono::steady_clock::now();
+        for (auto & worker : workers) {
+            if (worker.attrPaths.empty() || worker.timedOut || !worker.deadline || now < *worker.deadline)
+                continue;
+            printError("error: worker process %d timed out evaluating '%s'",
+                worker.pid, worker.current < worker.attrPaths.size() ? worker.attrPaths[worker.current] : "");
+            worker.timedOut = true;
+            if (kill(worker.pid, SIGKILL) == -1 && errno != ESRCH)
+                throw SysError("killing worker process %d", worker.pid);
+        }
+    }
+
+    /* The worker failed while evaluating its batch. An attribute that
+       failed on its own in a fresh worker gets the error; otherwise
+       the culprit isn't known, so retry them all as suspects. */
+    void batchFailed(Worker & worker, const std::string & error, bool blameLoneAttr = false)
+    {
+        auto attrPaths = std::move(worker.attrPaths);
+        worker.attrPaths.clear();
+
+        for (auto & attrPath : attrPaths)
+            active.erase(attrPath);
+
+        if (attrPaths.size() == 1 && (worker.nrDone == 0 || blameLoneAttr)) {
+            suspects.erase(attrPaths[0]);
+            nrAttrs++;
+            recordError(attrPaths[0], error);
+            checkpoint(attrPaths[0], {{"error", error}});
+            return;
+        }
+
+        for (auto & attrPath : attrPaths) {
+            suspects.insert(attrPath);
+            todo.insert({history.expectedCost(attrPath), attrPath});
+        }
+    }
+
+    /* Reload the results of an interrupted run from the checkpoint
+       file, and queue the attributes it discovered but didn't
+       complete. Those that were in flight are evaluated again. */
+    void resume()
+    {
+        std::set<std::string> discovered{""}, completed;
+
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile(checkpointFile), "\n")) {
+            nlohmann::json reply;
+            try {
+                reply = nlohmann::json::parse(line);
+            } catch (nlohmann::json::parse_error &) {
+                /* The last line may be cut short by the interruption. */
+                continue;
+            }
+
+            if (reply.find("expr") != reply.end()) {
+                if (reply["expr"] != myArgs.releaseExpr)
+                    throw Error("checkpoint file '%s' is for '%s', not '%s'",
+                        checkpointFile, (std::string) reply["expr"], myArgs.releaseExpr);
+                if (reply.find("inputs") == reply.end() || reply["inputs"] != inputs)
+                    throw Error("checkpoint file '%s' is for different inputs of '%s'; not resuming",
+                        checkpointFile, myArgs.releaseExpr);
+                continue;
+            }
+
+            std::string attrPath = reply["attr"];
+            completed.insert(attrPath);
+            recordResult(attrPath, reply);
+
+            if (reply.find("attrs") != reply.end())
+                for (auto & name : reply["attrs"])
+                    discovered.insert((attrPath.empty() ? "" : attrPath + ".") + (std::string) name);
+        }
+
+        checkpointFD = open(checkpointFile.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (!checkpointFD) throw SysError("opening '%s'", checkpointFile);
+
+        for (auto & attrPath : discovered)
+            if (!completed.count(attrPath))
+                enqueue(todo, attrPath);
+
+        nrResumed = completed.size();
+        printInfo("resuming with %d attributes evaluated", nrResumed);
+    }
+
+    /* Queue an attribute for evaluation, unless the cache has its
+       result, in which case its children are queued instead. */
+    void enqueue(std::set<Todo> & queue, const std::string & attrPath)
+    {
+        std::optional<nlohmann::json> reply;
+
+        if (cache && (reply = cache->lookup(attrPath)))
+            nrCached++;
+        else if (tracker && (reply = tracker->lookup(attrPath)))
+            nrReplayed++;
+
+        if (reply) {
+            recordResult(attrPath, *reply);
+            checkpoint(attrPath, *reply);
+            enqueueChildren(queue, attrPath, *reply);
+            return;
+        }
+
+        queue.insert({history.expectedCost(attrPath), attrPath});
+    }
+
+    void enqueueChildren(std::set<Todo> & queue, const std::string & attrPath, nlohmann::json & reply)
+    {
+        if (reply.find("attrs") != reply.end())
+            for (auto & name : reply["attrs"])
+                enqueue(queue, (attrPath.empty() ? "" : attrPath + ".") + (std::string) name);
+    }
+
+    /* Run an action that refers to the derivations received so far,
+       once they are in the store. */
+    void afterWrites(std::function<void()> action)
+    {
+        if (derivationWriter)
+            derivationWriter->after(std::move(action));
+        else
+            action();
+    }
+
+    /* Append a completed attribute to the checkpoint file. The line is
+       written directly, so that it survives the master being killed,
+       but not before the attribute's derivations have been written,
+       since resuming doesn't check that they're valid. */
+    void checkpoint(const std::string & attrPath, nlohmann::json reply)
+    {
+        if (!checkpointFD) return;
+        reply["attr"] = attrPath;
+        afterWrites([this, line{reply.dump() + "\n"}]() {
+            writeFull(checkpointFD.get(), line);
+        });
+    }
+
+    /* Record the job or error of an evaluated attribute. */
+    void recordResult(const std::string & attrPath, nlohmann::json & reply)
+    {
+        /* Only kept for --history-file, so that the master's memory
+           doesn't grow with the number of attributes otherwise. */
+        if (historyFile != "" && reply.find("cost") != reply.end())
+            history.measured[attrPath] = reply["cost"];
+
+        if (reply.find("job") != reply.end()) {
+            nrJobs++;
+            if (gcRootWriter && !myArgs.enumerate)
+                afterWrites([this, drvPath{(std::string) reply["job"]["drvPath"]}]() {
+                    gcRootWriter->add(drvPath);
+                });
+            auto job = reply["job"];
+            if (myArgs.jobFields.count("cost") && reply.find("cost") != reply.end())
+                job["cost"] = reply["cost"];
+            if (myArgs.stream) {
+                job["attr"] = attrPath;
+                afterWrites([job{std::move(job)}]() { printJob(job); });
+            } else
+                jobs[attrPath] = std::move(job);
+        }
+
+        if (reply.find("error") != reply.end())
+            recordError(attrPath, reply["error"]);
+    }
+
+    void recordError(const std::string & attrPath, const std::string & error)
+    {
+        nrErrors++;
+        if (myArgs.stream) {
+            nlohmann::json job;
+            job["attr"] = attrPath;
+            job["error"] = error;
+            printJob(job);
+        } else
+            jobs[attrPath]["error"] = error;
+    }
+
+    /* Record the replies to a batch. A worker that runs out of memory
+       returns fewer replies than it was given attributes. */
+    void handleReplies(Worker & worker, nlohmann::json & replies)
+    {
+        auto attrPaths = std::move(worker.attrPaths);
+        worker.attrPaths.clear();
+
+        /* Size the next batch so that it takes about targetBatchTime
+           to evaluate. */
+        if (!replies.empty()) {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - worker.batchStart;
+            auto perAttr = elapsed.count() / replies.size();
+            worker.attrTime = worker.attrTime == 0 ? perAttr : 0.8 * worker.attrTime + 0.2 * perAttr;
+            worker.batchSize = std::clamp(
+                (size_t) (targetBatchTime / std::max(worker.attrTime, 1e-6)),
+                (size_t) 1, maxBatchSize);
+        }
+
+        std::string stats;
+
+        std::optional<SQLiteTxn> txn, trackerTxn;
+        if (cache) txn.emplace(cache->db);
+        if (tracker) trackerTxn.emplace(tracker->db);
+
+        for (size_t i = 0; i < attrPaths.size(); i++) {
+            auto & attrPath = attrPaths[i];
+
+            /* The worker hit --max-heap-size on this attribute. */
+            if (i < replies.size() && replies[i].find("outOfMemory") != replies[i].end()) {
+                worker.attrPaths = {attrPath};
+                batchFailed(worker, "out of memory");
+                continue;
+            }
+
+            active.erase(attrPath);
+
+            /* Put back the attributes the worker didn't get to. */
+            if (i >= replies.size()) {
+                todo.insert({history.expectedCost(attrPath), attrPath});
+                continue;
+            }
+
+            nrAttrs++;
+            worker.nrDone++;
+            nrStartupFailures = 0;
+            suspects.erase(attrPath);
+
+            auto & reply = replies[i];
+
+            if (reply.find("drvs") != reply.end()) {
+                if (derivationWriter)
+                    derivationWriter->add(std::move(reply["drvs"]));
+                reply.erase("drvs");
+            }
+
+            if (reply.find("files") != reply.end()) {
+                if (tracker)
+                    tracker->addFiles(worker.chain, worker.chainLength, reply["files"]);
+                reply.erase("files");
+            }
+
+            if (statsFD) {
+                auto line = reply["cost"];
+                line["attr"] = attrPath;
+                line["kind"] =
+                    reply.find("job") != reply.end() ? "job" :
+                    reply.find("attrs") != reply.end() ? "attrs" :
+                    reply.find("error") != reply.end() ? "error" : "null";
+                stats += line.dump() + "\n";
+            }
+
+            recordResult(attrPath, reply);
+            checkpoint(attrPath, reply);
+            if (cache) cache->insert(attrPath, reply);
+            if (tracker) tracker->insert(attrPath, worker.chain, rootChainLength + worker.chainLength, reply);
+
+            enqueueChildren(worker.local, attrPath, reply);
+        }
+
+        if (txn) txn->commit();
+        if (trackerTxn) trackerTxn->commit();
+
+        if (!stats.empty())
+            writeFull(statsFD.get(), stats);
+    }
+
+    void assignWork(Worker & worker)
+    {
+        auto nrPending = this->nrPending();
+
+        if (nrPending == 0) {
+            if (active.empty()) {
+                writeMessage(worker.to.get(), "exit");
+                worker.idle = false;
+                worker.done = true;
+            }
+            return;
+        }
+
+        /* Prefer our own attributes, then unclaimed ones, then steal
+           from the worker with the longest queue. */
+        auto queue = &worker.local;
+        if (queue->empty()) queue = &todo;
+        if (queue->empty())
+            for (auto & other : workers)
+                if (other.local.size() > queue->size()) queue = &other.local;
+
+        /* Don't take more than our share of the queue, or other
+           workers go idle. Likewise, don't put attributes that were
+           expensive last time in the same batch. */
+        auto n = std::min(worker.batchSize, std::max<size_t>(1, nrPending / workers.size()));
+
+        /* A suspect is evaluated on its own by a fresh worker, so that
+           if it fails again, we know it's the culprit. */
+        if (suspects.count(queue->begin()->attrPath)) {
+            if (worker.nrDone) {
+                writeMessage(worker.to.get(), "exit");
+                restartWorker(worker);
+                return;
+            }
+            n = 1;
+        }
+
+        double batchCost = 0;
+        while (worker.attrPaths.size() < n && !queue->empty()) {
+            batchCost += queue->begin()->cost;
+            if (!worker.attrPaths.empty() && batchCost > targetBatchTime) break;
+            if (suspects.count(queue->begin()->attrPath) && !worker.attrPaths.empty()) break;
+            worker.attrPaths.push_back(queue->begin()->attrPath);
+            queue->erase(queue->begin());
+            active.insert(worker.attrPaths.back());
+        }
+
+        /* Tell the worker to evaluate them. */
+        worker.idle = false;
+        worker.batchStart = std::chrono::steady_clock::now();
+
+        /* The worker tells us when it starts on each attribute, which
+           restarts the clock. */
+        worker.current = 0;
+        worker.deadline.reset();
+        if (myArgs.attrTimeout)
+            worker.deadline = worker.batchStart + std::chrono::seconds(myArgs.attrTimeout);
+        writeMessage(worker.to.get(), {{"do", worker.attrPaths}});
+    }
+};
+
+int main(int argc, char * * argv)
+{
+    /* Prevent undeclared dependencies in the evaluation via
+       $NIX_PATH. */
+    unsetenv("NIX_PATH");
+
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        initGC();
+
+        myArgs.parseCmdline(argvToStrings(argc, argv));
+
+        /* FIXME: The build hook in conjunction with import-from-derivation is causing "unexpected EOF" during eval */
+        settings.builders = "";
+
+        /* Prevent access to paths outside of the Nix search path and
+           to the environment. */
+        evalSettings.restrictEval = true;
+
+        /* When building a flake, use pure evaluation (no access to
+           'getEnv', 'currentSystem' etc. */
+        evalSettings.pureEval = myArgs.flake;
+
+        if (myArgs.dryRun) settings.readOnlyMode = true;
+
+        if (myArgs.enumerate && myArgs.jobFields.count("outputs"))
+            throw UsageError("'--enumerate' can't compute outputs");
+
+        if (myArgs.releaseExpr == "") throw UsageError("no expression specified");
+
+        if (gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
+
+        if (traceFile != "") {
+            traceFD = open(traceFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+            if (!traceFD) throw SysError("creating '%s'", traceFile);
+            writeFull(traceFD.get(), "[\n");
+            traceProcess("master");
+        }
+
+        History history;
+        if (historyFile != "") history.load(historyFile);
+
+        /* Lock the flake once, here, rather than in each worker, so
+           that its inputs are fetched and copied to the store a
+           single time. */
+        std::unique_ptr<ResultCache> cache;
+        std::unique_ptr<DependencyTracker> tracker;
+        std::string inputs;
+        {
+            EvalState state(myArgs.searchPath, openEvalStore());
+
+            if (myArgs.flake) {
+                TraceSpan span("lockFlake");
+                lockedFlake.emplace(flake::lockFlake(state, flake::parseFlakeRef(myArgs.releaseExpr),
+                    flake::LockFlags {
+                        .updateLockFile = false,
+                        .useRegistries = false,
+                        .allowMutable = false,
+                    }));
+            }
+
+            if (lockedFlake)
+                mainSource = lockedFlake->flake.sourceInfo->actualPath;
+            else {
+                auto expr = absPath(myArgs.releaseExpr);
+                if (state.store->isInStore(expr))
+                    mainSource = state.store->printStorePath(state.store->toStorePath(expr).first);
+            }
+
+            if (myArgs.useCache) {
+                if (auto key = getCacheKey(state))
+                    cache = std::make_unique<ResultCache>(*key, state.store);
+                else
+                    printInfo("not using the result cache, since the inputs are mutable or can't be hashed");
+            }
+
+            if (myArgs.incremental) {
+                if (auto key = getReplayKey(state))
+                    tracker = std::make_unique<DependencyTracker>(*key, state.store);
+                else
+                    printInfo("not replaying attributes, since the auto arguments can't be hashed");
+            }
+
+            if (checkpointFile != "")
+                inputs = getInputsHash(state);
+        }
+
+        auto startTime = std::chrono::steady_clock::now();
+        auto startCPUTime = getCPUTime();
+
+        Master master(history, cache.get(), tracker.get(), inputs);
+        master.run();
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+        if (auto writer = master.derivationWriter.get(); writer && writer->writeTime > 0)
+            printInfo("wrote %d derivations in %.2f s (%.1f derivations/s), %d were already valid",
+                writer->nrWritten, writer->writeTime, writer->nrWritten / writer->writeTime, writer->nrValid);
+        if (master.nrCached)
+            printInfo("%d attributes were found in the result cache", master.nrCached);
+        if (master.nrReplayed)
+            printInfo("%d attributes were replayed, since their source files are unchanged", master.nrReplayed);
+        if (master.nrResumed)
+            printInfo("%d attributes were evaluated before resuming", master.nrResumed);
+        printInfo("evaluated %d attributes in %.2f s (%.1f attributes/s)",
+            master.nrAttrs, elapsed.count(), master.nrAttrs / elapsed.count());
+        printInfo("workers were restarted %d times for exceeding the memory limit", master.nrRestarts);
+
+        struct rusage r;
+        getrusage(RUSAGE_SELF, &r);
+        printInfo("master peak RSS was %d MiB", r.ru_maxrss / 1024);
+
+        /* The master's own CPU time is the scheduling overhead. */
+        if (master.nrAttrs)
+            printInfo("master used %.1f us of CPU time per attribute",
+                (getCPUTime() - startCPUTime) * 1e6 / master.nrAttrs);
 
-        if (state->exc)
-            std::rethrow_exception(state->exc);
+        if (historyFile != "") history.save(historyFile);
 
-        std::cout << state->jobs.dump(2) << "\n";
+        if (!myArgs.stream)
+            std::cout << master.jobs.dump(2) << "\n";
     });
 }
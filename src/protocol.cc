@@ -0,0 +1,75 @@
+#include "protocol.hh"
+
+#include <nix/config.h>
+#include <nix/util.hh>
+
+using namespace nix;
+
+/* Refuse to allocate a buffer for a length that can only be garbage. */
+static const uint32_t maxMessageSize = 1U << 30;
+
+void writeMessage(int fd, const nlohmann::json & msg)
+{
+    auto payload = nlohmann::json::to_cbor(msg);
+    if (payload.size() > maxMessageSize)
+        throw Error("message of %d bytes is too large", payload.size());
+
+    std::string frame;
+    frame.reserve(4 + payload.size());
+    uint32_t len = payload.size();
+    for (int i = 0; i < 4; i++)
+        frame.push_back((char) ((len >> (i * 8)) & 0xff));
+    frame.append(payload.begin(), payload.end());
+
+    writeFull(fd, frame);
+}
+
+bool MessageReader::fill()
+{
+    /* Discard consumed input before reading more. */
+    if (pos) {
+        buffer.erase(buffer.begin(), buffer.begin() + pos);
+        pos = 0;
+    }
+
+    auto size = buffer.size();
+    buffer.resize(size + 65536);
+
+    ssize_t n;
+    while ((n = ::read(fd, buffer.data() + size, buffer.size() - size)) == -1) {
+        if (errno == EINTR) continue;
+        buffer.resize(size);
+        if (errno == EAGAIN) return true;
+        throw SysError("reading message");
+    }
+
+    buffer.resize(size + n);
+    return n != 0;
+}
+
+std::optional<nlohmann::json> MessageReader::next()
+{
+    if (buffer.size() - pos < 4) return {};
+
+    uint32_t len = 0;
+    for (int i = 0; i < 4; i++)
+        len |= (uint32_t) buffer[pos + i] << (i * 8);
+    if (len > maxMessageSize)
+        throw Error("received message of %d bytes, which is too large", len);
+
+    if (buffer.size() - pos - 4 < len) return {};
+
+    auto start = buffer.begin() + pos + 4;
+    auto msg = nlohmann::json::from_cbor(start, start + len);
+    pos += 4 + len;
+
+    return msg;
+}
+
+nlohmann::json MessageReader::read()
+{
+    while (true) {
+        if (auto msg = next()) return std::move(*msg);
+        if (!fill()) throw EndOfFile("unexpected end-of-file");
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+/* Messages between the master and the workers are JSON values, sent as
+   a 32-bit little-endian length followed by their CBOR encoding. */
+
+/* Write a message to a file descriptor in a single write. */
+void writeMessage(int fd, const nlohmann::json & msg);
+
+/* Reads messages from a file descriptor. Input is buffered, so a
+   message costs a single read(2) in the common case rather than one
+   per byte. */
+class MessageReader
+{
+    int fd;
+    std::vector<uint8_t> buffer;
+    size_t pos = 0;
+
+public:
+
+    MessageReader(int fd = -1) : fd(fd) { }
+
+    /* Read whatever input is available. Returns false on end-of-file.
+       On a non-blocking file descriptor, returns true if there was
+       nothing to read. */
+    bool fill();
+
+    /* Return the next complete message in the buffer, if any. */
+    std::optional<nlohmann::json> next();
+
+    /* Block until a message is available and return it. */
+    nlohmann::json read();
+};